@@ -1,5 +1,7 @@
 #include "chunk.h"
 #include "memory.h"
+#include "object.h"
+#include "vm.h"
 
 void initChunk(Chunk* chunk) {
   chunk->count = 0;
@@ -29,6 +31,149 @@ void freeChunk(Chunk* chunk) {
 }
 
 int addConstant(Chunk* chunk, Value value) {
+  // the value may not be reachable yet while the array grows.
+  push(value);
   writeValueArray(&chunk->constants, value);
+  pop();
   return chunk->constants.count - 1;
 }
+
+// the size in bytes of the instruction at "offset", operands included.
+int instructionLength(Chunk* chunk, int offset) {
+  switch (chunk->code[offset]) {
+  case OP_CONSTANT:
+  case OP_POPN:
+  case OP_CLOSE_UPVALUES:
+  case OP_SET_LOCAL:
+  case OP_GET_LOCAL:
+  case OP_CALL:
+  case OP_TAIL_CALL:
+  case OP_GET_UPVALUE:
+  case OP_SET_UPVALUE:
+  case OP_GET_ENCLOSING:
+  case OP_SET_ENCLOSING:
+  case OP_GET_FLAT_UPVALUE:
+  case OP_SET_LOCAL_POP:
+    return 2;
+  case OP_DEFINE_GLOBAL:
+  case OP_GET_GLOBAL:
+  case OP_SET_GLOBAL:
+  case OP_JUMPZ:
+  case OP_JUMP:
+  case OP_LOOP:
+  case OP_ADD_LOCALS:
+  case OP_POP_JUMPZ:
+    return 3;
+  case OP_LESS_LOCAL_CONST_JUMPZ:
+    return 5;
+  case OP_CLOSURE: {
+    ObjFunction* function =
+        AS_FUNCTION(chunk->constants.values[chunk->code[offset + 1]]);
+    return 2 + 2 * function->upvalueCount;
+  }
+  case OP_STACK_CLOSURE: {
+    ObjClosure* closure =
+        AS_CLOSURE(chunk->constants.values[chunk->code[offset + 1]]);
+    return 2 + 2 * closure->function->upvalueCount;
+  }
+  default:
+    return 1;
+  }
+}
+
+static int readShort(uint8_t* code) { return (code[0] << 8) | code[1]; }
+
+// the offset a jump instruction at "offset" goes to, -1 if
+// it isn't a jump.
+int jumpTarget(Chunk* chunk, int offset) {
+  uint8_t* code = &chunk->code[offset];
+  switch (code[0]) {
+  case OP_JUMPZ:
+  case OP_JUMP:
+  case OP_POP_JUMPZ:
+    return offset + 3 + readShort(code + 1);
+  case OP_LOOP:
+    return offset + 3 - readShort(code + 1);
+  case OP_LESS_LOCAL_CONST_JUMPZ:
+    return offset + 5 + readShort(code + 3);
+  default:
+    return -1;
+  }
+}
+
+// how many values the instruction at "offset" pushes
+// minus how many it pops.
+static int stackEffect(Chunk* chunk, int offset) {
+  switch (chunk->code[offset]) {
+  case OP_CONSTANT:
+  case OP_NIL:
+  case OP_TRUE:
+  case OP_FALSE:
+  case OP_GET_GLOBAL:
+  case OP_GET_LOCAL:
+  case OP_GET_UPVALUE:
+  case OP_CLOSURE:
+  case OP_STACK_CLOSURE:
+  case OP_GET_ENCLOSING:
+  case OP_GET_FLAT_UPVALUE:
+  case OP_ADD_LOCALS:
+    return 1;
+  case OP_RETURN:
+  case OP_EQUAL:
+  case OP_NOT_EQUAL:
+  case OP_LESS:
+  case OP_GREATER:
+  case OP_MULT:
+  case OP_DIV:
+  case OP_ADD:
+  case OP_SUB:
+  case OP_PRINT:
+  case OP_POP:
+  case OP_DEFINE_GLOBAL:
+  case OP_POP_JUMPZ:
+  case OP_SET_LOCAL_POP:
+    return -1;
+  case OP_POPN:
+  case OP_CLOSE_UPVALUES:
+  case OP_CALL:
+  case OP_TAIL_CALL:
+    return -chunk->code[offset + 1];
+  default:
+    return 0;
+  }
+}
+
+// fills depths[offset] with the number of values in the frame (the
+// callee and the parameters included) before the instruction at
+// "offset" runs, -1 where no instruction starts. code that can't be
+// reached gets the depth the compiler had when it emitted it.
+// returns the largest depth.
+int stackDepths(Chunk* chunk, int arity, int* depths) {
+  for (int offset = 0; offset < chunk->count; offset++) {
+    depths[offset] = -1;
+  }
+
+  int depth = arity + 1;
+  int maxDepth = depth;
+  bool reachable = true;
+  for (int offset = 0; offset < chunk->count;
+       offset += instructionLength(chunk, offset)) {
+    // after a jump, the depth is the one the
+    // jumps to this instruction arrive with.
+    if (!reachable && depths[offset] >= 0)
+      depth = depths[offset];
+    depths[offset] = depth;
+
+    depth += stackEffect(chunk, offset);
+    if (depth > maxDepth)
+      maxDepth = depth;
+
+    int target = jumpTarget(chunk, offset);
+    if (target > offset)
+      depths[target] = depth;
+
+    uint8_t op = chunk->code[offset];
+    reachable = op != OP_JUMP && op != OP_LOOP && op != OP_RETURN;
+  }
+  return maxDepth;
+}
\ No newline at end of file
@@ -52,9 +52,48 @@ typedef enum {
   OP_CLOSURE,
   OP_GET_UPVALUE,
   OP_SET_UPVALUE,
-  OP_CLOSE_UPVALUE
+  // pops the top n values, closing the upvalues of the ones that
+  // were captured.
+  OP_CLOSE_UPVALUES,
+  // a call in a return statement, it runs the callee in the
+  // caller's frame. always followed by OP_RETURN, which returns
+  // the result when the call couldn't reuse the frame.
+  OP_TAIL_CALL,
+  // a local function that is only ever called by the function that
+  // declares it runs above that function's frame, it reads and writes
+  // the variables it captures in the frame below its own (see
+  // shareFrame() in compiler.c). its closure has no upvalues and is
+  // made once, OP_STACK_CLOSURE pushes it from the constant pool and
+  // skips the capture operands OP_CLOSURE had.
+  OP_STACK_CLOSURE,
+  OP_GET_ENCLOSING,
+  OP_SET_ENCLOSING,
+  // an upvalue whose variable is never assigned, the closure
+  // holds a copy of its value instead of an ObjUpvalue.
+  OP_GET_FLAT_UPVALUE,
+
+  // superinstructions: fused forms of the sequences that showed up
+  // most in an opcode pair profile of the scripts in bench/ (build
+  // with DEBUG_PROFILE_OPCODES). GET_LOCAL -> CONSTANT, CONSTANT ->
+  // LESS, LESS -> JUMPZ and JUMPZ -> POP are near the top in all of
+  // them, GET_LOCAL -> GET_LOCAL, ADD -> SET_LOCAL, SET_LOCAL -> POP
+  // and EQUAL -> NOT in the nested loops.
+  OP_NOT_EQUAL,              // OP_EQUAL, OP_NOT
+  OP_ADD_LOCALS,             // OP_GET_LOCAL a, OP_GET_LOCAL b, OP_ADD
+  OP_POP_JUMPZ,              // OP_JUMPZ offset, OP_POP on both paths
+  OP_LESS_LOCAL_CONST_JUMPZ, // OP_GET_LOCAL a, OP_CONSTANT k, OP_LESS,
+                             // OP_POP_JUMPZ offset
+  OP_SET_LOCAL_POP           // OP_SET_LOCAL a, OP_POP
 } OpCode;
 
+// OP_CLOSURE's operands are the function's constant, then a
+// (kind, index) pair for each of its upvalues.
+typedef enum {
+  CAPTURE_UPVALUE, // upvalue "index" of the running closure, as is.
+  CAPTURE_LOCAL,   // local "index", through an ObjUpvalue.
+  CAPTURE_VALUE    // a copy of local "index", which never changes.
+} CaptureKind;
+
 typedef struct {
   size_t count;
   size_t capacity;
@@ -67,5 +106,8 @@ void initChunk(Chunk* chunk);
 void freeChunk(Chunk* chunk);
 void writeChunk(Chunk* chunk, uint8_t code, int line);
 int addConstant(Chunk* chunk, Value constant);
+int instructionLength(Chunk* chunk, int offset);
+int jumpTarget(Chunk* chunk, int offset);
+int stackDepths(Chunk* chunk, int arity, int* depths);
 
 #endif
\ No newline at end of file
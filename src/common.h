@@ -7,7 +7,39 @@
 
 #define DEBUG_PRINT_CODE
 // #define DEBUG_TRACE_EXECTUION
-#define DEBUG_STRESS_GC
+// #define DEBUG_PROFILE_OPCODES
+// collect on every allocation instead of once the heap has grown.
+// #define DEBUG_STRESS_GC
 #define DEBUG_LOG_GC
 
+// represent a Value as a NaN-boxed 64 bit word instead of a
+// tagged union (16 bytes). compile with -DNO_NAN_BOXING to use
+// the tagged union.
+#ifndef NO_NAN_BOXING
+#define NAN_BOXING
+#endif
+
+// compile hot functions to machine code (see jit.h). it needs
+// x86-64 Linux and NaN boxing, compile with -DNO_JIT to leave
+// it out.
+#if defined(__x86_64__) && defined(__linux__) && defined(NAN_BOXING) &&      \
+    !defined(NO_JIT)
+#define JIT
+#endif
+
+// share the marking of a full collection between threads (clox
+// --gc-threads <n>) and mark on a background thread (clox
+// --gc-concurrent). it needs pthreads, compile with
+// -DNO_PARALLEL_GC to leave it out.
+#if defined(__unix__) && !defined(NO_PARALLEL_GC)
+#define PARALLEL_GC
+#endif
+
+// dispatch opcodes in the VM through a table of label addresses
+// (GCC/Clang "labels as values") instead of a switch statement.
+// compile with -DNO_COMPUTED_GOTO to use the portable switch.
+#if (defined(__GNUC__) || defined(__clang__)) && !defined(NO_COMPUTED_GOTO)
+#define COMPUTED_GOTO
+#endif
+
 #endif
\ No newline at end of file
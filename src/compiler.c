@@ -8,8 +8,10 @@
 #include "common.h"
 #include "memory.h"
 #include "object.h"
+#include "regcompiler.h"
 #include "scanner.h"
 #include "value.h"
+#include "vm.h"
 
 #ifdef DEBUG_PRINT_CODE
 #include "debug.h"
@@ -25,7 +27,15 @@ typedef struct {
 typedef struct {
   Token name;
   int depth;
-  bool isCaptured;
+  // how many functions capture it.
+  int captures;
+  // where its code starts in the chunk, for a local function
+  // its OP_CLOSURE.
+  int start;
+  // a local function, and whether it was used
+  // as anything but a callee.
+  bool isFunction;
+  bool escapes;
 } Local;
 
 typedef struct {
@@ -51,6 +61,15 @@ typedef struct {
   Upvalue upvalues[UINT8_MAX + 1];
   int upvalueCount;
   int scopeDepth;
+  // where the left operand of the infix expression being
+  // compiled starts in the chunk, and where the last
+  // OP_SET_LOCAL was emitted. superinstructions are only
+  // formed over code that is known to be one expression.
+  int operandStart;
+  int lastSetLocal;
+  // where the last OP_CALL was emitted, a return
+  // statement turns it into OP_TAIL_CALL.
+  int lastCall;
 } Compiler;
 
 Parser parser;
@@ -148,6 +167,13 @@ static void emitBytes(uint8_t byte1, uint8_t byte2) {
   emitByte(byte2);
 }
 
+// an instruction with a 16 bit operand, high byte first.
+static void emitShortOp(uint8_t op, uint16_t operand) {
+  emitByte(op);
+  emitByte((operand >> 8) & 0xff);
+  emitByte(operand & 0xff);
+}
+
 static void emitReturn() {
   emitByte(OP_NIL);
   emitByte(OP_RETURN);
@@ -175,6 +201,9 @@ static void patchJump(int offset) {
 
   currentChunk()->code[offset] = (jump >> 8) & 0xff;
   currentChunk()->code[offset + 1] = jump & 0xff;
+  // the jump lands after the last instruction, so it
+  // can't be fused with whatever comes next.
+  current->lastSetLocal = -1;
 }
 
 static void emitLoop(int loopStart) {
@@ -192,6 +221,7 @@ static uint8_t makeConstant(Value value) {
   // addConstant returns the index in the pool to which
   // the constant was added.
   int constantIndex = addConstant(currentChunk(), value);
+  writeBarrier((Obj*)current->function, value);
 
   if (constantIndex > UINT8_MAX) {
     error("Too many constants in one chunk.");
@@ -212,6 +242,9 @@ static void initCompiler(Compiler* compiler, FunctionType type) {
   compiler->function = NULL;
   compiler->localCount = 0;
   compiler->scopeDepth = 0;
+  compiler->operandStart = -1;
+  compiler->lastSetLocal = -1;
+  compiler->lastCall = -1;
   compiler->type = type;
   compiler->function = newFunction();
   current = compiler;
@@ -219,23 +252,247 @@ static void initCompiler(Compiler* compiler, FunctionType type) {
   if (type != TYPE_SCRIPT) {
     current->function->name =
         copyString(parser.previous.start, parser.previous.length);
+    writeBarrier((Obj*)current->function,
+                 OBJ_VAL(current->function->name));
   }
 
   Local* local = &current->locals[current->localCount++];
   local->depth = 0;
   local->name.start = "";
   local->name.length = 0;
-  local->isCaptured = false;
+  local->captures = 0;
+  local->start = 0;
+  local->isFunction = false;
+  local->escapes = false;
+}
+
+// whether the local function "local" only runs while the function
+// that declares it is the caller, as far as the code compiled so far
+// tells: it is only ever the callee of a call, nothing captures it
+// and everything it captures is a local of that function.
+static bool canShareFrame(Local* local) {
+  if (!local->isFunction || local->escapes)
+    return false;
+
+  // one that captures nothing is a constant closure already.
+  Chunk* chunk = currentChunk();
+  uint8_t* code = &chunk->code[local->start];
+  if (code[0] != OP_CLOSURE)
+    return false;
+  ObjFunction* function = AS_FUNCTION(chunk->constants.values[code[1]]);
+  for (int i = 0; i < function->upvalueCount; i++) {
+    if (code[2 + 2 * i] != CAPTURE_LOCAL)
+      return false;
+  }
+
+  // a closure made inside it would capture an upvalue it won't have.
+  Chunk* inner = &function->chunk;
+  for (int offset = 0; offset < inner->count;
+       offset += instructionLength(inner, offset)) {
+    if (inner->code[offset] != OP_CLOSURE)
+      continue;
+    ObjFunction* nested =
+        AS_FUNCTION(inner->constants.values[inner->code[offset + 1]]);
+    for (int i = 0; i < nested->upvalueCount; i++) {
+      if (inner->code[offset + 2 + 2 * i] == CAPTURE_UPVALUE)
+        return false;
+    }
+  }
+  return true;
+}
+
+// once "local" goes out of scope every use of it is known. a function
+// that can share its caller's frame becomes a stack closure: its
+// upvalue accesses go straight to the slots of the frame below, and
+// the OP_CLOSURE that captured them pushes one closure made here.
+static void shareFrame(Local* local) {
+  if (parser.hadError || !canShareFrame(local))
+    return;
+
+  Chunk* chunk = currentChunk();
+  uint8_t* code = &chunk->code[local->start];
+  ObjFunction* function = AS_FUNCTION(chunk->constants.values[code[1]]);
+  Chunk* inner = &function->chunk;
+  for (int offset = 0; offset < inner->count;
+       offset += instructionLength(inner, offset)) {
+    uint8_t* op = &inner->code[offset];
+    if (op[0] == OP_GET_UPVALUE || op[0] == OP_SET_UPVALUE) {
+      op[0] = op[0] == OP_GET_UPVALUE ? OP_GET_ENCLOSING : OP_SET_ENCLOSING;
+      op[1] = code[3 + 2 * op[1]];
+    }
+  }
+  for (int i = 0; i < function->upvalueCount; i++) {
+    current->locals[code[3 + 2 * i]].captures--;
+  }
+
+  // the operands stay, the capture pairs are skipped.
+  code[0] = OP_STACK_CLOSURE;
+  Value closure = OBJ_VAL(newClosure(function));
+  preWriteBarrier(chunk->constants.values[code[1]]);
+  chunk->constants.values[code[1]] = closure;
+  writeBarrier((Obj*)current->function, closure);
+
+  // its register code was made from the upvalue accesses.
+  if (vm.registerMode && !compileRegisters(function)) {
+    error("Too many registers in function.");
+  }
+
+#ifdef DEBUG_PRINT_CODE
+  disassembleChunk(inner, function->name->chars);
+#endif
+}
+
+// the upvalue of the OP_CLOSURE at "code" that
+// captures local "slot", -1 if none does.
+static int capturedAt(uint8_t* code, ObjFunction* function, int slot) {
+  for (int i = 0; i < function->upvalueCount; i++) {
+    if (code[2 + 2 * i] == CAPTURE_LOCAL && code[3 + 2 * i] == slot)
+      return i;
+  }
+  return -1;
+}
+
+// whether "function", or a closure made in it,
+// assigns its upvalue "index".
+static bool assignsUpvalue(ObjFunction* function, int index) {
+  Chunk* chunk = &function->chunk;
+  for (int offset = 0; offset < chunk->count;
+       offset += instructionLength(chunk, offset)) {
+    uint8_t* code = &chunk->code[offset];
+    if (code[0] == OP_SET_UPVALUE && code[1] == index)
+      return true;
+    if (code[0] != OP_CLOSURE)
+      continue;
+    ObjFunction* nested = AS_FUNCTION(chunk->constants.values[code[1]]);
+    for (int i = 0; i < nested->upvalueCount; i++) {
+      if (code[2 + 2 * i] == CAPTURE_UPVALUE && code[3 + 2 * i] == index &&
+          assignsUpvalue(nested, i))
+        return true;
+    }
+  }
+  return false;
+}
+
+// whether the stack closure "function" assigns local "slot".
+static bool assignsEnclosing(ObjFunction* function, int slot) {
+  Chunk* chunk = &function->chunk;
+  for (int offset = 0; offset < chunk->count;
+       offset += instructionLength(chunk, offset)) {
+    if (chunk->code[offset] == OP_SET_ENCLOSING &&
+        chunk->code[offset + 1] == slot)
+      return true;
+  }
+  return false;
+}
+
+// has "function", and the closures made in it that
+// copy the upvalue, read upvalue "index" as a value.
+static void flattenUpvalue(ObjFunction* function, int index) {
+  Chunk* chunk = &function->chunk;
+  for (int offset = 0; offset < chunk->count;
+       offset += instructionLength(chunk, offset)) {
+    uint8_t* code = &chunk->code[offset];
+    if (code[0] == OP_GET_UPVALUE && code[1] == index)
+      code[0] = OP_GET_FLAT_UPVALUE;
+    if (code[0] != OP_CLOSURE)
+      continue;
+    ObjFunction* nested = AS_FUNCTION(chunk->constants.values[code[1]]);
+    for (int i = 0; i < nested->upvalueCount; i++) {
+      if (code[2 + 2 * i] == CAPTURE_UPVALUE && code[3 + 2 * i] == index)
+        flattenUpvalue(nested, i);
+    }
+  }
+
+  if (vm.registerMode && !compileRegisters(function)) {
+    error("Too many registers in function.");
+  }
+}
+
+// a captured local that is never assigned can't change after the
+// closures capturing it are made: they get a copy of its value
+// instead of an ObjUpvalue, and it is popped instead of closed.
+static void flattenCaptures(Local* local) {
+  if (parser.hadError || local->captures == 0)
+    return;
+
+  int slot = (int)(local - current->locals);
+  Chunk* chunk = currentChunk();
+  for (int offset = local->start; offset < chunk->count;
+       offset += instructionLength(chunk, offset)) {
+    uint8_t* code = &chunk->code[offset];
+    switch (code[0]) {
+    case OP_SET_LOCAL:
+    case OP_SET_LOCAL_POP:
+      if (code[1] == slot)
+        return;
+      break;
+    case OP_STACK_CLOSURE: {
+      ObjClosure* closure = AS_CLOSURE(chunk->constants.values[code[1]]);
+      if (assignsEnclosing(closure->function, slot))
+        return;
+      break;
+    }
+    case OP_CLOSURE: {
+      ObjFunction* function = AS_FUNCTION(chunk->constants.values[code[1]]);
+      int index = capturedAt(code, function, slot);
+      if (index >= 0 && assignsUpvalue(function, index))
+        return;
+      break;
+    }
+    }
+  }
+
+  for (int offset = local->start; offset < chunk->count;
+       offset += instructionLength(chunk, offset)) {
+    uint8_t* code = &chunk->code[offset];
+    if (code[0] != OP_CLOSURE)
+      continue;
+    ObjFunction* function = AS_FUNCTION(chunk->constants.values[code[1]]);
+    int index = capturedAt(code, function, slot);
+    if (index >= 0) {
+      code[2 + 2 * index] = CAPTURE_VALUE;
+      flattenUpvalue(function, index);
+    }
+  }
+  local->captures = 0;
+}
+
+// every use of "local" is known once it goes out of scope.
+static void endLocal(Local* local) {
+  shareFrame(local);
+  flattenCaptures(local);
 }
 
 static ObjFunction* endCompiler() {
+  // the locals of the function's outermost scope are never
+  // popped, their uses end here.
+  for (int i = current->localCount - 1; i > 0; i--) {
+    endLocal(&current->locals[i]);
+  }
+
   emitReturn();
   ObjFunction* func = current->function;
 
+  // call() makes room for the whole frame up front,
+  // the VM's pushes don't check the stack's size.
+  int* depths = malloc(sizeof(int) * currentChunk()->count);
+  if (depths == NULL)
+    exit(1);
+  func->maxStack = stackDepths(currentChunk(), func->arity, depths);
+  free(depths);
+
+  if (vm.registerMode && !parser.hadError && !compileRegisters(func)) {
+    error("Too many registers in function.");
+  }
+
 #ifdef DEBUG_PRINT_CODE
   if (!parser.hadError) {
     disassembleChunk(currentChunk(),
                      func->name != NULL ? func->name->chars : "<script>");
+    if (vm.registerMode) {
+      disassembleRegChunk(&func->registerCode, &currentChunk()->constants,
+                          func->name != NULL ? func->name->chars : "<script>");
+    }
   }
 #endif
 
@@ -249,15 +506,25 @@ static void endScope() {
   current->scopeDepth--;
   uint8_t popCount = 0;
 
+  bool captured = false;
+
   while (current->localCount > 0 &&
          current->locals[current->localCount - 1].depth > current->scopeDepth) {
-    if (current->locals[current->localCount - 1].isCaptured) {
-      emitByte(OP_CLOSE_UPVALUE);
-    } else {
-      emitByte(OP_POP);
-    }
+    endLocal(&current->locals[current->localCount - 1]);
+    if (current->locals[current->localCount - 1].captures > 0) captured = true;
+    popCount++;
     current->localCount--;
   }
+
+  // one instruction for the whole scope, closing is a single
+  // sweep over the slots however many of them were captured.
+  if (captured) {
+    emitBytes(OP_CLOSE_UPVALUES, popCount);
+  } else if (popCount == 1) {
+    emitByte(OP_POP);
+  } else if (popCount > 1) {
+    emitBytes(OP_POPN, popCount);
+  }
 }
 
 static bool check(TokenType type) { return parser.current.type == type; }
@@ -344,6 +611,7 @@ ParseRule rules[] = {
 static ParseRule* getRule(TokenType type) { return &rules[type]; }
 
 static void parsePrecedence(Precedence precedence) {
+  int start = currentChunk()->count;
   advance();
   ParseFn prefixRule = getRule(parser.previous.type)->prefix;
 
@@ -358,6 +626,7 @@ static void parsePrecedence(Precedence precedence) {
   while (precedence <= getRule(parser.current.type)->precedence) {
     advance();
     ParseFn infixRule = getRule(parser.previous.type)->infix;
+    current->operandStart = start;
     infixRule(canAssign);
   }
 
@@ -366,8 +635,16 @@ static void parsePrecedence(Precedence precedence) {
   }
 }
 
-static uint8_t identifierConstant(Token* name) {
-  return makeConstant(OBJ_VAL(copyString(name->start, name->length)));
+// globals are resolved to a slot in the VM's global
+// array at compile time instead of being looked up by name.
+static uint16_t globalSlot(Token* name) {
+  int slot = declareGlobal(copyString(name->start, name->length));
+
+  if (slot > UINT16_MAX) {
+    error("Too many global variables.");
+    return 0;
+  }
+  return (uint16_t)slot;
 }
 
 static bool identifiersEqual(Token* a, Token* b) {
@@ -396,6 +673,8 @@ static int addUpvalue(Compiler* compiler, uint8_t index, bool isLocal) {
 
   compiler->upvalues[count].index = index;
   compiler->upvalues[count].isLocal = isLocal;
+  if (isLocal)
+    ((Compiler*)compiler->enclosing)->locals[index].captures++;
 
   return compiler->function->upvalueCount++;
 }
@@ -432,8 +711,9 @@ static int resolveUpvalue(Compiler* compiler, Token* name) {
     if (local == -1)
       return -1;
     isLocal = false;
+  } else {
+    enclosing->locals[local].escapes = true;
   }
-  enclosing->locals[local].isCaptured = true;
   return addUpvalue(compiler, (uint8_t)local, isLocal);
 }
 
@@ -446,7 +726,10 @@ static void addLocal(Token name) {
   Local* local = &current->locals[current->localCount++];
   local->name = name;
   local->depth = -1;
-  local->isCaptured = false;
+  local->captures = 0;
+  local->start = currentChunk()->count;
+  local->isFunction = false;
+  local->escapes = false;
 }
 
 static void declareVariable() {
@@ -469,12 +752,12 @@ static void declareVariable() {
   addLocal(*name);
 }
 
-static uint8_t parseVariable(const char* errorMessage) {
+static uint16_t parseVariable(const char* errorMessage) {
   consume(TOKEN_IDENTIFIER, errorMessage);
   declareVariable();
   if (current->scopeDepth > 0)
     return 0;
-  return identifierConstant(&parser.previous);
+  return globalSlot(&parser.previous);
 }
 
 static void markInitialized() {
@@ -483,13 +766,13 @@ static void markInitialized() {
   current->locals[current->localCount - 1].depth = current->scopeDepth;
 }
 
-static void defineVariable(uint8_t global) {
+static void defineVariable(uint16_t global) {
   if (current->scopeDepth > 0) {
     markInitialized();
     return;
   }
 
-  emitBytes(OP_DEFINE_GLOBAL, global);
+  emitShortOp(OP_DEFINE_GLOBAL, global);
 }
 
 static void and (bool canAssign) {
@@ -530,17 +813,30 @@ static void namedVariable(Token name, bool canAssign) {
     getOp = OP_GET_UPVALUE;
     setOp = OP_SET_UPVALUE;
   } else {
-    arg = identifierConstant(&name);
+    arg = globalSlot(&name);
     getOp = OP_GET_GLOBAL;
     setOp = OP_SET_GLOBAL;
   }
 
+  uint8_t op = getOp;
   if (canAssign && match(TOKEN_EQUAL)) {
     expression();
-    emitBytes(setOp, (uint8_t)arg);
+    op = setOp;
+  }
+
+  // a local function that is only called may not need a closure.
+  if (getOp == OP_GET_LOCAL &&
+      (op == OP_SET_LOCAL || !check(TOKEN_LEFT_PAREN)))
+    current->locals[arg].escapes = true;
+
+  if (getOp == OP_GET_GLOBAL) {
+    emitShortOp(op, (uint16_t)arg);
   } else {
-    emitBytes(getOp, (uint8_t)arg);
+    emitBytes(op, (uint8_t)arg);
   }
+
+  if (op == OP_SET_LOCAL)
+    current->lastSetLocal = currentChunk()->count - 2;
 }
 
 static void variable(bool canAssign) {
@@ -591,7 +887,17 @@ static uint8_t parseArgs() {
 }
 
 static void call(bool canAssign) {
+  int callee = current->operandStart;
+  int arguments = currentChunk()->count;
   uint8_t argCount = parseArgs();
+
+  // a stack closure runs above its caller's frame,
+  // a call to it can't replace that frame.
+  Chunk* chunk = currentChunk();
+  bool sharesFrame = arguments - callee == 2 &&
+                     chunk->code[callee] == OP_GET_LOCAL &&
+                     canShareFrame(&current->locals[chunk->code[callee + 1]]);
+  current->lastCall = sharesFrame ? -1 : chunk->count;
   emitBytes(OP_CALL, argCount);
 }
 
@@ -614,7 +920,7 @@ static void declaration() {
 }
 
 static void varDeclaration() {
-  uint8_t global = parseVariable("Expected variable name.");
+  uint16_t global = parseVariable("Expected variable name.");
 
   if (match(TOKEN_EQUAL)) {
     expression();
@@ -636,6 +942,12 @@ static void returnStatement() {
   } else {
     expression();
     consume(TOKEN_SEMICOLON, "Expect ';' after return value.");
+    // the value is the result of a call: the callee can
+    // take over the frame instead of returning into it.
+    Chunk* chunk = currentChunk();
+    if (current->lastCall == chunk->count - 2) {
+      chunk->code[chunk->count - 2] = OP_TAIL_CALL;
+    }
     emitByte(OP_RETURN);
   }
 }
@@ -676,9 +988,9 @@ static void function(FunctionType type) {
         errorAtCurrent("Cannot have more than 255 parameters.");
       }
 
-      uint8_t paramConstant = parseVariable("Expect paramter name.");
+      uint16_t paramConstant = parseVariable("Expect paramter name.");
       defineVariable(paramConstant);
-    } while (check(TOKEN_COMMA));
+    } while (match(TOKEN_COMMA));
   }
   consume(TOKEN_RIGHT_PAREN, "Expected ')' after function parameters.");
 
@@ -686,17 +998,29 @@ static void function(FunctionType type) {
   block();
 
   ObjFunction* function = endCompiler();
+  if (function->upvalueCount == 0) {
+    // every closure of a function that captures nothing is the same,
+    // the one made here is pushed as a constant whenever the
+    // declaration runs.
+    push(OBJ_VAL(function));
+    Value closure = OBJ_VAL(newClosure(function));
+    pop();
+    emitConstant(closure);
+    return;
+  }
   emitBytes(OP_CLOSURE, makeConstant(OBJ_VAL(function)));
 
   for (int i = 0; i < function->upvalueCount; i++) {
-    emitByte(compiler.upvalues[i].isLocal ? 1 : 0);
+    emitByte(compiler.upvalues[i].isLocal ? CAPTURE_LOCAL : CAPTURE_UPVALUE);
     emitByte(compiler.upvalues[i].index);
   }
 }
 
 static void funDeclaration() {
-  uint8_t global = parseVariable("Expected function name.");
+  uint16_t global = parseVariable("Expected function name.");
   markInitialized();
+  if (current->scopeDepth > 0)
+    current->locals[current->localCount - 1].isFunction = true;
   function(TYPE_FUNCTION);
   defineVariable(global);
 }
@@ -707,34 +1031,66 @@ static void printStatement() {
   emitByte(OP_PRINT);
 }
 
+// pops the value of an expression that was compiled for its
+// side effect. an assignment to a local right before it is
+// turned into a store that pops.
+static void emitPopResult() {
+  Chunk* chunk = currentChunk();
+  if (current->lastSetLocal == chunk->count - 2) {
+    chunk->code[chunk->count - 2] = OP_SET_LOCAL_POP;
+    return;
+  }
+  emitByte(OP_POP);
+}
+
+// emits the jump taken when the condition on top of the stack is
+// falsey. the condition is popped on both paths. "start" is where
+// the condition's code begins, a `local < constant` condition is
+// rewritten into a single compare-and-branch instruction.
+// returns the offset of the jump operand for patchJump().
+static int emitConditionJump(int start) {
+  Chunk* chunk = currentChunk();
+  if (chunk->count - start == 5 && chunk->code[start] == OP_GET_LOCAL &&
+      chunk->code[start + 2] == OP_CONSTANT && chunk->code[start + 4] == OP_LESS) {
+    uint8_t slot = chunk->code[start + 1];
+    uint8_t constant = chunk->code[start + 3];
+    chunk->count = start;
+    emitBytes(OP_LESS_LOCAL_CONST_JUMPZ, slot);
+    emitByte(constant);
+    emitByte(0xff);
+    emitByte(0xff);
+    return chunk->count - 2;
+  }
+  return emitJump(OP_POP_JUMPZ);
+}
+
 static void expressionStatement() {
   expression();
   consume(TOKEN_SEMICOLON, "expected ';' after expression");
-  emitByte(OP_POP);
+  emitPopResult();
 }
 
 static void ifStatement() {
   consume(TOKEN_LEFT_PAREN, "Expected '(' after 'if'");
 
   // compile the condition.
+  int conditionStart = currentChunk()->count;
   expression();
   consume(TOKEN_RIGHT_PAREN, "Expected ')' after if condition.");
 
-  int thenJump = emitJump(OP_JUMPZ);
-
-  // if the condition was true, pop it off the stack and run
-  // the statement body.
-  emitByte(OP_POP);
+  // the condition is popped by the jump, if it was true
+  // run the statement body.
+  int thenJump = emitConditionJump(conditionStart);
   statement();
 
-  int elseJump = emitJump(OP_JUMP);
-
-  patchJump(thenJump);
-  emitByte(OP_POP);
-
-  if (match(TOKEN_ELSE))
+  if (match(TOKEN_ELSE)) {
+    int elseJump = emitJump(OP_JUMP);
+    patchJump(thenJump);
     statement();
-  patchJump(elseJump);
+    patchJump(elseJump);
+  } else {
+    patchJump(thenJump);
+  }
 }
 
 static void whileStatement() {
@@ -744,13 +1100,11 @@ static void whileStatement() {
   expression();
   consume(TOKEN_RIGHT_PAREN, "Expected ')' after condition.");
 
-  int exitJump = emitJump(OP_JUMPZ);
-  emitByte(OP_POP);
+  int exitJump = emitConditionJump(loopStart);
   statement();
   emitLoop(loopStart);
 
   patchJump(exitJump);
-  emitByte(OP_POP);
 }
 
 static void forStatement() {
@@ -771,8 +1125,7 @@ static void forStatement() {
   if (!match(TOKEN_SEMICOLON)) {
     expression();
     consume(TOKEN_SEMICOLON, "Expected ';'");
-    exitJmp = emitJump(OP_JUMPZ);
-    emitByte(OP_POP);
+    exitJmp = emitConditionJump(loopStart);
   }
 
   // increment.
@@ -783,7 +1136,7 @@ static void forStatement() {
     expression();
     consume(TOKEN_RIGHT_PAREN, "Expected ')' after for-loop clause.");
 
-    emitByte(OP_POP);
+    emitPopResult();
 
     emitLoop(loopStart);
     loopStart = incrStart;
@@ -792,12 +1145,14 @@ static void forStatement() {
 
   statement();
   emitLoop(loopStart);
-  endScope();
 
   if (exitJmp != -1) {
     patchJump(exitJmp);
-    emitByte(OP_POP); // pop the condition off the stack.
   }
+
+  // the loop variable is popped on the way out of the loop,
+  // so the exit jump has to land before the scope ends.
+  endScope();
 }
 
 static void synchronize() {
@@ -827,6 +1182,8 @@ static void synchronize() {
 
 static void binary(bool canAssign) {
   TokenType operator= parser.previous.type;
+  int leftStart = current->operandStart;
+  int rightStart = currentChunk()->count;
 
   //  Compile the right hand operand
   ParseRule* rule = getRule(operator);
@@ -840,7 +1197,7 @@ static void binary(bool canAssign) {
   //  Emit the operator instruction
   switch (operator) {
   case TOKEN_BANG_EQUAL:
-    emitBytes(OP_EQUAL, OP_NOT);
+    emitByte(OP_NOT_EQUAL);
     break;
   case TOKEN_EQUAL_EQUAL:
     emitByte(OP_EQUAL);
@@ -857,9 +1214,22 @@ static void binary(bool canAssign) {
   case TOKEN_LESS_EQUAL:
     emitBytes(OP_GREATER, OP_NOT);
     break;
-  case TOKEN_PLUS:
+  case TOKEN_PLUS: {
+    // both operands are a single OP_GET_LOCAL.
+    Chunk* chunk = currentChunk();
+    if (rightStart - leftStart == 2 && chunk->count - rightStart == 2 &&
+        chunk->code[leftStart] == OP_GET_LOCAL &&
+        chunk->code[rightStart] == OP_GET_LOCAL) {
+      uint8_t a = chunk->code[leftStart + 1];
+      uint8_t b = chunk->code[rightStart + 1];
+      chunk->count = leftStart;
+      emitBytes(OP_ADD_LOCALS, a);
+      emitByte(b);
+      break;
+    }
     emitByte(OP_ADD);
     break;
+  }
   case TOKEN_MINUS:
     emitByte(OP_SUB);
     break;
@@ -2,8 +2,65 @@
 
 #include "object.h"
 #include "value.h"
+#include "vm.h"
 #include <stdio.h>
 
+static const char* opcodeNames[] = {
+    [OP_RETURN] = "OP_RETURN",
+    [OP_CONSTANT] = "OP_CONSTANT",
+    [OP_NIL] = "OP_NIL",
+    [OP_NOT] = "OP_NOT",
+    [OP_TRUE] = "OP_TRUE",
+    [OP_FALSE] = "OP_FALSE",
+    [OP_EQUAL] = "OP_EQUAL",
+    [OP_LESS] = "OP_LESS",
+    [OP_GREATER] = "OP_GREATER",
+    [OP_NEGATE] = "OP_NEGATE",
+    [OP_MULT] = "OP_MULT",
+    [OP_DIV] = "OP_DIV",
+    [OP_ADD] = "OP_ADD",
+    [OP_SUB] = "OP_SUB",
+    [OP_PRINT] = "OP_PRINT",
+    [OP_POP] = "OP_POP",
+    [OP_POPN] = "OP_POPN",
+    [OP_DEFINE_GLOBAL] = "OP_DEFINE_GLOBAL",
+    [OP_GET_GLOBAL] = "OP_GET_GLOBAL",
+    [OP_SET_GLOBAL] = "OP_SET_GLOBAL",
+    [OP_SET_LOCAL] = "OP_SET_LOCAL",
+    [OP_GET_LOCAL] = "OP_GET_LOCAL",
+    [OP_JUMPZ] = "OP_JUMPZ",
+    [OP_JUMP] = "OP_JUMP",
+    [OP_LOOP] = "OP_LOOP",
+    [OP_CALL] = "OP_CALL",
+    [OP_TAIL_CALL] = "OP_TAIL_CALL",
+    [OP_CLOSURE] = "OP_CLOSURE",
+    [OP_GET_UPVALUE] = "OP_GET_UPVALUE",
+    [OP_SET_UPVALUE] = "OP_SET_UPVALUE",
+    [OP_CLOSE_UPVALUES] = "OP_CLOSE_UPVALUES",
+    [OP_STACK_CLOSURE] = "OP_STACK_CLOSURE",
+    [OP_GET_ENCLOSING] = "OP_GET_ENCLOSING",
+    [OP_SET_ENCLOSING] = "OP_SET_ENCLOSING",
+    [OP_GET_FLAT_UPVALUE] = "OP_GET_FLAT_UPVALUE",
+    [OP_NOT_EQUAL] = "OP_NOT_EQUAL",
+    [OP_ADD_LOCALS] = "OP_ADD_LOCALS",
+    [OP_POP_JUMPZ] = "OP_POP_JUMPZ",
+    [OP_LESS_LOCAL_CONST_JUMPZ] = "OP_LESS_LOCAL_CONST_JUMPZ",
+    [OP_SET_LOCAL_POP] = "OP_SET_LOCAL_POP",
+};
+
+static const char* captureKinds[] = {
+    [CAPTURE_UPVALUE] = "upvalue",
+    [CAPTURE_LOCAL] = "local",
+    [CAPTURE_VALUE] = "value",
+};
+
+const char* opcodeName(uint8_t opcode) {
+  if (opcode >= sizeof(opcodeNames) / sizeof(opcodeNames[0]) ||
+      opcodeNames[opcode] == NULL)
+    return "OP_UNKNOWN";
+  return opcodeNames[opcode];
+}
+
 void disassembleChunk(Chunk* chunk, const char* name) {
   printf("== %s ==\n\n", name);
   for (int offset = 0; offset < chunk->count;) {
@@ -31,6 +88,15 @@ static int byteInstruction(const char* name, Chunk* chunk, int offset) {
   return offset + 2;
 }
 
+static int globalInstruction(const char* name, Chunk* chunk, int offset) {
+  uint16_t slot =
+      (uint16_t)((chunk->code[offset + 1] << 8) | chunk->code[offset + 2]);
+  printf("%-16s\t%4d '", name, slot);
+  printValue(vm.globalNames.values[slot]);
+  printf("'\n");
+  return offset + 3;
+}
+
 static int jumpInstruction(char* name, Chunk* chunk, int offset) {
   uint8_t low = chunk->code[offset + 1];
   uint8_t high = chunk->code[offset + 2];
@@ -84,11 +150,11 @@ int disassembleInstruction(Chunk* chunk, int offset) {
   case OP_POPN:
     return byteInstruction("OP_POPN", chunk, offset);
   case OP_DEFINE_GLOBAL:
-    return constantInstruction("OP_DEFINE_GLOBAL", chunk, offset);
+    return globalInstruction("OP_DEFINE_GLOBAL", chunk, offset);
   case OP_GET_GLOBAL:
-    return constantInstruction("OP_GET_GLOBAL", chunk, offset);
+    return globalInstruction("OP_GET_GLOBAL", chunk, offset);
   case OP_SET_GLOBAL:
-    return constantInstruction("OP_SET_GLOBAL", chunk, offset);
+    return globalInstruction("OP_SET_GLOBAL", chunk, offset);
   case OP_SET_LOCAL:
     return byteInstruction("OP_SET_LOCAL", chunk, offset);
   case OP_GET_LOCAL:
@@ -101,6 +167,8 @@ int disassembleInstruction(Chunk* chunk, int offset) {
     return jumpInstruction("OP_LOOP", chunk, offset);
   case OP_CALL:
     return byteInstruction("OP_CALL", chunk, offset);
+  case OP_TAIL_CALL:
+    return byteInstruction("OP_TAIL_CALL", chunk, offset);
   case OP_CLOSURE: {
     offset++;
     uint8_t index = chunk->code[offset++];
@@ -109,10 +177,10 @@ int disassembleInstruction(Chunk* chunk, int offset) {
     printf("\n");
     ObjFunction* function = AS_FUNCTION(chunk->constants.values[index]);
     for (int j = 0; j < function->upvalueCount; j++) {
-      int isLocal = chunk->code[offset++];
+      int kind = chunk->code[offset++];
       int index = chunk->code[offset++];
       printf("%04d       |                       %s %d\n", offset - 2,
-             isLocal ? "local" : "upvalue", index);
+             captureKinds[kind], index);
     }
 
     return offset;
@@ -121,10 +189,210 @@ int disassembleInstruction(Chunk* chunk, int offset) {
     return byteInstruction("OP_SET_UPVALUE", chunk, offset);
   case OP_GET_UPVALUE:
     return byteInstruction("OP_GET_UPVALUE", chunk, offset);
-  case OP_CLOSE_UPVALUE:
-    return simpleInstruction("OP_CLOSE_UPVALUE", offset);
+  case OP_CLOSE_UPVALUES:
+    return byteInstruction("OP_CLOSE_UPVALUES", chunk, offset);
+  case OP_STACK_CLOSURE: {
+    uint8_t index = chunk->code[offset + 1];
+    printf("%-16s %4d ", "OP_STACK_CLOSURE", index);
+    printValue(chunk->constants.values[index]);
+    printf("\n");
+    return offset + instructionLength(chunk, offset);
+  }
+  case OP_GET_ENCLOSING:
+    return byteInstruction("OP_GET_ENCLOSING", chunk, offset);
+  case OP_SET_ENCLOSING:
+    return byteInstruction("OP_SET_ENCLOSING", chunk, offset);
+  case OP_GET_FLAT_UPVALUE:
+    return byteInstruction("OP_GET_FLAT_UPVALUE", chunk, offset);
+  case OP_NOT_EQUAL:
+    return simpleInstruction("OP_NOT_EQUAL", offset);
+  case OP_ADD_LOCALS: {
+    printf("%-16s\t%4d %4d\n", "OP_ADD_LOCALS", chunk->code[offset + 1],
+           chunk->code[offset + 2]);
+    return offset + 3;
+  }
+  case OP_POP_JUMPZ:
+    return jumpInstruction("OP_POP_JUMPZ", chunk, offset);
+  case OP_LESS_LOCAL_CONST_JUMPZ: {
+    uint8_t slot = chunk->code[offset + 1];
+    uint8_t index = chunk->code[offset + 2];
+    uint16_t jump =
+        (uint16_t)((chunk->code[offset + 3] << 8) | chunk->code[offset + 4]);
+    printf("%-16s\t%4d %4d '", "OP_LESS_LOCAL_CONST_JUMPZ", slot, index);
+    printValue(chunk->constants.values[index]);
+    printf("' %d\n", jump);
+    return offset + 5;
+  }
+  case OP_SET_LOCAL_POP:
+    return byteInstruction("OP_SET_LOCAL_POP", chunk, offset);
   default:
     printf("Unknown opcode.. %d\n", chunk->code[offset]);
     return offset + 1;
   }
 }
+
+static const char* regOpcodeNames[] = {
+    [ROP_MOVE] = "ROP_MOVE",
+    [ROP_LOADK] = "ROP_LOADK",
+    [ROP_LOADNIL] = "ROP_LOADNIL",
+    [ROP_LOADTRUE] = "ROP_LOADTRUE",
+    [ROP_LOADFALSE] = "ROP_LOADFALSE",
+    [ROP_GET_GLOBAL] = "ROP_GET_GLOBAL",
+    [ROP_DEFINE_GLOBAL] = "ROP_DEFINE_GLOBAL",
+    [ROP_SET_GLOBAL] = "ROP_SET_GLOBAL",
+    [ROP_GET_UPVALUE] = "ROP_GET_UPVALUE",
+    [ROP_SET_UPVALUE] = "ROP_SET_UPVALUE",
+    [ROP_GET_FLAT] = "ROP_GET_FLAT",
+    [ROP_GET_ENCLOSING] = "ROP_GET_ENCLOSING",
+    [ROP_SET_ENCLOSING] = "ROP_SET_ENCLOSING",
+    [ROP_ADD] = "ROP_ADD",
+    [ROP_SUB] = "ROP_SUB",
+    [ROP_MULT] = "ROP_MULT",
+    [ROP_DIV] = "ROP_DIV",
+    [ROP_EQUAL] = "ROP_EQUAL",
+    [ROP_NOT_EQUAL] = "ROP_NOT_EQUAL",
+    [ROP_LESS] = "ROP_LESS",
+    [ROP_GREATER] = "ROP_GREATER",
+    [ROP_NOT] = "ROP_NOT",
+    [ROP_NEGATE] = "ROP_NEGATE",
+    [ROP_PRINT] = "ROP_PRINT",
+    [ROP_JUMP] = "ROP_JUMP",
+    [ROP_JUMPZ] = "ROP_JUMPZ",
+    [ROP_EQUAL_JUMPZ] = "ROP_EQUAL_JUMPZ",
+    [ROP_NOT_EQUAL_JUMPZ] = "ROP_NOT_EQUAL_JUMPZ",
+    [ROP_LESS_JUMPZ] = "ROP_LESS_JUMPZ",
+    [ROP_GREATER_JUMPZ] = "ROP_GREATER_JUMPZ",
+    [ROP_CALL] = "ROP_CALL",
+    [ROP_TAIL_CALL] = "ROP_TAIL_CALL",
+    [ROP_CLOSURE] = "ROP_CLOSURE",
+    [ROP_CLOSE_UPVALUES] = "ROP_CLOSE_UPVALUES",
+    [ROP_RETURN] = "ROP_RETURN",
+};
+
+const char* regOpcodeName(uint8_t opcode) {
+  if (opcode >= sizeof(regOpcodeNames) / sizeof(regOpcodeNames[0]) ||
+      regOpcodeNames[opcode] == NULL)
+    return "ROP_UNKNOWN";
+  return regOpcodeNames[opcode];
+}
+
+void disassembleRegChunk(RegChunk* chunk, ValueArray* constants,
+                         const char* name) {
+  printf("== %s (%d registers) ==\n\n", name, chunk->registerCount);
+  for (int offset = 0; offset < chunk->count;) {
+    offset = disassembleRegInstruction(chunk, constants, offset);
+  }
+}
+
+// prints an RK operand: rN for a register, kN 'value' for a constant.
+static void printOperand(ValueArray* constants, uint32_t operand) {
+  if (REG_IS_K(operand)) {
+    int index = operand & 0xff;
+    printf(" k%d '", index);
+    printValue(constants->values[index]);
+    printf("'");
+  } else {
+    printf(" r%d", operand);
+  }
+}
+
+int disassembleRegInstruction(RegChunk* chunk, ValueArray* constants,
+                              int offset) {
+  printf("%04d\t", offset);
+  if (offset > 0 && chunk->lines[offset] == chunk->lines[offset - 1])
+    printf("   | ");
+  else
+    printf("%4d ", chunk->lines[offset]);
+
+  uint32_t instruction = chunk->code[offset];
+  printf("%-20s", regOpcodeName(REG_OP(instruction)));
+  switch (REG_OP(instruction)) {
+  case ROP_MOVE:
+    printf(" r%d r%d\n", REG_A(instruction), REG_B(instruction));
+    return offset + 1;
+  case ROP_LOADK:
+    printf(" r%d", REG_A(instruction));
+    printOperand(constants, REG_K | REG_BX(instruction));
+    printf("\n");
+    return offset + 1;
+  case ROP_LOADNIL:
+  case ROP_LOADTRUE:
+  case ROP_LOADFALSE:
+  case ROP_CLOSE_UPVALUES:
+    printf(" r%d\n", REG_A(instruction));
+    return offset + 1;
+  case ROP_GET_GLOBAL:
+  case ROP_DEFINE_GLOBAL:
+  case ROP_SET_GLOBAL:
+    printf(" r%d g%d '", REG_A(instruction), REG_BX(instruction));
+    printValue(vm.globalNames.values[REG_BX(instruction)]);
+    printf("'\n");
+    return offset + 1;
+  case ROP_GET_UPVALUE:
+  case ROP_GET_FLAT:
+    printf(" r%d u%d\n", REG_A(instruction), REG_B(instruction));
+    return offset + 1;
+  case ROP_SET_UPVALUE:
+    printf(" u%d", REG_A(instruction));
+    printOperand(constants, REG_B(instruction));
+    printf("\n");
+    return offset + 1;
+  case ROP_GET_ENCLOSING:
+    printf(" r%d e%d\n", REG_A(instruction), REG_B(instruction));
+    return offset + 1;
+  case ROP_SET_ENCLOSING:
+    printf(" e%d", REG_A(instruction));
+    printOperand(constants, REG_B(instruction));
+    printf("\n");
+    return offset + 1;
+  case ROP_NOT:
+  case ROP_NEGATE:
+    printf(" r%d", REG_A(instruction));
+    printOperand(constants, REG_B(instruction));
+    printf("\n");
+    return offset + 1;
+  case ROP_PRINT:
+  case ROP_RETURN:
+    printOperand(constants, REG_B(instruction));
+    printf("\n");
+    return offset + 1;
+  case ROP_JUMP:
+    printf(" -> %04d\n", offset + 1 + REG_SBX(instruction));
+    return offset + 1;
+  case ROP_JUMPZ:
+    printf(" r%d -> %04d\n", REG_A(instruction),
+           offset + 1 + REG_SBX(instruction));
+    return offset + 1;
+  case ROP_EQUAL_JUMPZ:
+  case ROP_NOT_EQUAL_JUMPZ:
+  case ROP_LESS_JUMPZ:
+  case ROP_GREATER_JUMPZ:
+    printOperand(constants, REG_B(instruction));
+    printOperand(constants, REG_C(instruction));
+    printf(" -> %04d\n", offset + 2 + (int32_t)chunk->code[offset + 1]);
+    return offset + 2;
+  case ROP_CALL:
+  case ROP_TAIL_CALL:
+    printf(" r%d %d\n", REG_A(instruction), REG_B(instruction));
+    return offset + 1;
+  case ROP_CLOSURE: {
+    Value value = constants->values[REG_BX(instruction)];
+    printf(" r%d k%d ", REG_A(instruction), REG_BX(instruction));
+    printValue(value);
+    printf("\n");
+    ObjFunction* function = AS_FUNCTION(value);
+    for (int j = 0; j < function->upvalueCount; j++) {
+      uint32_t capture = chunk->code[++offset];
+      printf("%04d       |                       %s %d\n", offset,
+             captureKinds[capture >> 8], capture & 0xff);
+    }
+    return offset + 1;
+  }
+  default:
+    printf(" r%d", REG_A(instruction));
+    printOperand(constants, REG_B(instruction));
+    printOperand(constants, REG_C(instruction));
+    printf("\n");
+    return offset + 1;
+  }
+}
\ No newline at end of file
@@ -2,8 +2,15 @@
 #define clox_debug_h
 
 #include "chunk.h"
+#include "regchunk.h"
 
 void disassembleChunk(Chunk* chunk, const char* name);
 int disassembleInstruction(Chunk* chunk, int offset);
+const char* opcodeName(uint8_t opcode);
+void disassembleRegChunk(RegChunk* chunk, ValueArray* constants,
+                         const char* name);
+int disassembleRegInstruction(RegChunk* chunk, ValueArray* constants,
+                              int offset);
+const char* regOpcodeName(uint8_t opcode);
 
 #endif
\ No newline at end of file
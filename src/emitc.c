@@ -0,0 +1,483 @@
+#include "emitc.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "vm.h"
+
+static const char* prelude =
+    "// generated by clox --emit-c, see emitc.h.\n"
+    "#include <math.h>\n"
+    "#include <stdio.h>\n"
+    "\n"
+    "#include \"object.h\"\n"
+    "#include \"vm.h\"\n"
+    "\n"
+    "#define FALSEY(value) (IS_NIL(value) || (IS_BOOL(value) && "
+    "!AS_BOOL(value)))\n"
+    "// a call can move the stack, the frames and the closure.\n"
+    "#define RELOAD()                                                 \\\n"
+    "  (frame = &vm.frames[frameIndex], slots = frame->slots,         \\\n"
+    "   closure = AS_CLOSURE(slots[0]))\n"
+    "// the line of a runtime error, or of a call in a stack trace.\n"
+    "#define AT(offset) (frame->ip = code + (offset) + 1)\n"
+    "#define ERROR(offset, ...)                                       \\\n"
+    "  do {                                                           \\\n"
+    "    AT(offset);                                                  \\\n"
+    "    runtimeError(__VA_ARGS__);                                   \\\n"
+    "    return false;                                                \\\n"
+    "  } while (false)\n"
+    "#define NUMBERS(a, b, offset)                                    \\\n"
+    "  do {                                                           \\\n"
+    "    if (!IS_NUMBER(a) || !IS_NUMBER(b))                          \\\n"
+    "      ERROR(offset, \"Operands must be numbers.\");                \\\n"
+    "  } while (false)\n"
+    "#define ADD(a, b, result, depth, offset)                         \\\n"
+    "  do {                                                           \\\n"
+    "    if (IS_NUMBER(a) && IS_NUMBER(b)) {                          \\\n"
+    "      result = NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b));          \\\n"
+    "    } else if (IS_STRING(a) && IS_STRING(b)) {                   \\\n"
+    "      vm.stack.top = slots + (depth);                            \\\n"
+    "      result = OBJ_VAL(joinStrings(AS_STRING(a), AS_STRING(b))); \\\n"
+    "    } else {                                                     \\\n"
+    "      ERROR(offset, \"Operands must be two numbers or two strings.\"); "
+    "\\\n"
+    "    }                                                            \\\n"
+    "  } while (false)\n";
+
+typedef struct {
+  ObjFunction** functions;
+  int count;
+  int capacity;
+} FunctionList;
+
+static int functionIndex(FunctionList* list, ObjFunction* function) {
+  for (int i = 0; i < list->count; i++) {
+    if (list->functions[i] == function)
+      return i;
+  }
+  return -1;
+}
+
+// numbers every function reachable from "function" through
+// the constant pools, the script is function 0.
+static void collectFunctions(FunctionList* list, ObjFunction* function) {
+  if (functionIndex(list, function) >= 0)
+    return;
+  if (list->count + 1 > list->capacity) {
+    list->capacity = list->capacity < 8 ? 8 : list->capacity * 2;
+    list->functions =
+        realloc(list->functions, sizeof(ObjFunction*) * list->capacity);
+    if (list->functions == NULL)
+      exit(1);
+  }
+  list->functions[list->count++] = function;
+
+  ValueArray* constants = &function->chunk.constants;
+  for (int i = 0; i < constants->count; i++) {
+    if (IS_FUNCTION(constants->values[i])) {
+      collectFunctions(list, AS_FUNCTION(constants->values[i]));
+    } else if (IS_CLOSURE(constants->values[i])) {
+      collectFunctions(list, AS_CLOSURE(constants->values[i])->function);
+    }
+  }
+}
+
+// the shortest literal that reads back as "number".
+static void printNumber(FILE* out, double number) {
+  if (isinf(number)) {
+    fprintf(out, number < 0 ? "-HUGE_VAL" : "HUGE_VAL");
+    return;
+  }
+  char buffer[32];
+  for (int precision = 15; precision <= 17; precision++) {
+    snprintf(buffer, sizeof(buffer), "%.*g", precision, number);
+    if (strtod(buffer, NULL) == number)
+      break;
+  }
+  fputs(buffer, out);
+}
+
+static void printString(FILE* out, const char* chars, int length) {
+  fputc('"', out);
+  for (int i = 0; i < length; i++) {
+    unsigned char c = (unsigned char)chars[i];
+    if (c == '"' || c == '\\') {
+      fprintf(out, "\\%c", c);
+    } else if (c >= 0x20 && c < 0x7f) {
+      fputc(c, out);
+    } else {
+      fprintf(out, "\\%03o", c);
+    }
+  }
+  fputc('"', out);
+}
+
+// numbers are put in the code for the C compiler to fold,
+// everything else is read from the constant pool.
+static void printConstant(FILE* out, Chunk* chunk, int index) {
+  Value constant = chunk->constants.values[index];
+  if (IS_NUMBER(constant)) {
+    fprintf(out, "NUMBER_VAL(");
+    printNumber(out, AS_NUMBER(constant));
+    fprintf(out, ")");
+  } else {
+    fprintf(out, "constants[%d]", index);
+  }
+}
+
+static int readShort(uint8_t* code) { return (code[0] << 8) | code[1]; }
+
+static const char* globalName(int slot) {
+  return AS_CSTRING(vm.globalNames.values[slot]);
+}
+
+static void emitInstruction(FILE* out, ObjFunction* function, int index,
+                            int offset, int depth) {
+  Chunk* chunk = &function->chunk;
+  uint8_t* code = &chunk->code[offset];
+  int top = depth - 1;
+
+  switch (code[0]) {
+  case OP_CONSTANT:
+  case OP_STACK_CLOSURE:
+    fprintf(out, "  slots[%d] = ", depth);
+    printConstant(out, chunk, code[1]);
+    fprintf(out, ";\n");
+    break;
+  case OP_NIL:
+    fprintf(out, "  slots[%d] = NIL_VAL;\n", depth);
+    break;
+  case OP_TRUE:
+  case OP_FALSE:
+    fprintf(out, "  slots[%d] = BOOL_VAL(%s);\n", depth,
+            code[0] == OP_TRUE ? "true" : "false");
+    break;
+  case OP_POP:
+  case OP_POPN:
+    break;
+  case OP_GET_LOCAL:
+    fprintf(out, "  slots[%d] = slots[%d];\n", depth, code[1]);
+    break;
+  case OP_SET_LOCAL:
+  case OP_SET_LOCAL_POP:
+    fprintf(out, "  slots[%d] = slots[%d];\n", code[1], top);
+    break;
+  case OP_GET_GLOBAL: {
+    int slot = readShort(code + 1);
+    fprintf(out, "  slots[%d] = vm.globalValues.values[%d];\n", depth, slot);
+    fprintf(out, "  if (IS_UNDEFINED(slots[%d]))\n", depth);
+    fprintf(out, "    ERROR(%d, \"Undefined global '%s'.\");\n", offset,
+            globalName(slot));
+    break;
+  }
+  case OP_SET_GLOBAL: {
+    int slot = readShort(code + 1);
+    fprintf(out, "  if (IS_UNDEFINED(vm.globalValues.values[%d]))\n", slot);
+    fprintf(out, "    ERROR(%d, \"Undefined variable '%s'.\");\n", offset,
+            globalName(slot));
+    fprintf(out, "  vm.globalValues.values[%d] = slots[%d];\n", slot, top);
+    break;
+  }
+  case OP_DEFINE_GLOBAL:
+    fprintf(out, "  vm.globalValues.values[%d] = slots[%d];\n",
+            readShort(code + 1), top);
+    break;
+  case OP_GET_UPVALUE:
+    fprintf(out, "  slots[%d] = *AS_UPVALUE(closure->upvalues[%d])->slot;\n",
+            depth, code[1]);
+    break;
+  case OP_GET_FLAT_UPVALUE:
+    fprintf(out, "  slots[%d] = closure->upvalues[%d];\n", depth, code[1]);
+    break;
+  case OP_SET_UPVALUE:
+    fprintf(out, "  {\n");
+    fprintf(out,
+            "    ObjUpvalue* upvalue = AS_UPVALUE(closure->upvalues[%d]);\n",
+            code[1]);
+    fprintf(out, "    preWriteBarrier(*upvalue->slot);\n");
+    fprintf(out, "    *upvalue->slot = slots[%d];\n", top);
+    fprintf(out, "    writeBarrier((Obj*)upvalue, slots[%d]);\n", top);
+    fprintf(out, "  }\n");
+    break;
+  case OP_GET_ENCLOSING:
+    fprintf(out, "  slots[%d] = vm.frames[frameIndex - 1].slots[%d];\n",
+            depth, code[1]);
+    break;
+  case OP_SET_ENCLOSING:
+    fprintf(out, "  vm.frames[frameIndex - 1].slots[%d] = slots[%d];\n",
+            code[1], top);
+    break;
+  case OP_EQUAL:
+  case OP_NOT_EQUAL:
+    fprintf(out, "  slots[%d] = BOOL_VAL(%svaluesEqual(slots[%d], slots[%d]));\n",
+            top - 1, code[0] == OP_NOT_EQUAL ? "!" : "", top - 1, top);
+    break;
+  case OP_GREATER:
+  case OP_LESS:
+  case OP_SUB:
+  case OP_MULT:
+  case OP_DIV: {
+    const char* op = code[0] == OP_GREATER ? ">"
+                     : code[0] == OP_LESS  ? "<"
+                     : code[0] == OP_SUB   ? "-"
+                     : code[0] == OP_MULT  ? "*"
+                                           : "/";
+    const char* type =
+        code[0] == OP_GREATER || code[0] == OP_LESS ? "BOOL_VAL" : "NUMBER_VAL";
+    fprintf(out, "  NUMBERS(slots[%d], slots[%d], %d);\n", top - 1, top,
+            offset);
+    fprintf(out,
+            "  slots[%d] = %s(AS_NUMBER(slots[%d]) %s AS_NUMBER(slots[%d]));\n",
+            top - 1, type, top - 1, op, top);
+    break;
+  }
+  case OP_ADD:
+    fprintf(out, "  ADD(slots[%d], slots[%d], slots[%d], %d, %d);\n", top - 1,
+            top, top - 1, depth, offset);
+    break;
+  case OP_ADD_LOCALS:
+    fprintf(out, "  ADD(slots[%d], slots[%d], slots[%d], %d, %d);\n", code[1],
+            code[2], depth, depth, offset);
+    break;
+  case OP_NOT:
+    fprintf(out, "  slots[%d] = BOOL_VAL(FALSEY(slots[%d]));\n", top, top);
+    break;
+  case OP_NEGATE:
+    fprintf(out, "  if (!IS_NUMBER(slots[%d]))\n", top);
+    fprintf(out, "    ERROR(%d, \"Operand must be a number.\");\n", offset);
+    fprintf(out, "  slots[%d] = NUMBER_VAL(-AS_NUMBER(slots[%d]));\n", top,
+            top);
+    break;
+  case OP_PRINT:
+    fprintf(out, "  printValue(slots[%d]);\n", top);
+    fprintf(out, "  printf(\"\\n\");\n");
+    break;
+  case OP_LOOP:
+    // a safepoint for the GC, like in the interpreter.
+    fprintf(out, "  if (safepointDue()) {\n");
+    fprintf(out, "    vm.stack.top = slots + %d;\n", depth);
+    fprintf(out, "    gcSafepoint();\n");
+    fprintf(out, "    closure = AS_CLOSURE(slots[0]);\n");
+    fprintf(out, "  }\n");
+    // fallthrough
+  case OP_JUMP:
+    fprintf(out, "  goto L%d;\n", jumpTarget(chunk, offset));
+    break;
+  case OP_JUMPZ:
+  case OP_POP_JUMPZ:
+    fprintf(out, "  if (FALSEY(slots[%d]))\n", top);
+    fprintf(out, "    goto L%d;\n", jumpTarget(chunk, offset));
+    break;
+  case OP_LESS_LOCAL_CONST_JUMPZ:
+    fprintf(out, "  NUMBERS(slots[%d], ", code[1]);
+    printConstant(out, chunk, code[2]);
+    fprintf(out, ", %d);\n", offset);
+    fprintf(out, "  if (!(AS_NUMBER(slots[%d]) < AS_NUMBER(", code[1]);
+    printConstant(out, chunk, code[2]);
+    fprintf(out, ")))\n");
+    fprintf(out, "    goto L%d;\n", jumpTarget(chunk, offset));
+    break;
+  case OP_TAIL_CALL: {
+    // the callee takes over the frame: this function starts over
+    // if it calls itself, any other one is run by callCompiled()
+    // once this returns. natives, and callees whose frame doesn't
+    // fit in the stack from here, get an ordinary call.
+    int callee = depth - code[1] - 1;
+    fprintf(out, "  if (IS_CLOSURE(slots[%d]) &&\n", callee);
+    fprintf(out, "      AS_CLOSURE(slots[%d])->function->arity == %d &&\n",
+            callee, code[1]);
+    fprintf(out, "      slots + AS_CLOSURE(slots[%d])->function->maxStack <=\n",
+            callee);
+    fprintf(out, "          vm.stack.values + vm.stack.size) {\n");
+    fprintf(out, "    closeUpvalues(slots);\n");
+    for (int i = 0; i <= code[1]; i++) {
+      fprintf(out, "    slots[%d] = slots[%d];\n", i, callee + i);
+    }
+    fprintf(out, "    closure = AS_CLOSURE(slots[0]);\n");
+    fprintf(out, "    frame->closure = closure;\n");
+    fprintf(out, "    if (closure->function->compiled == function%d)\n",
+            index);
+    fprintf(out, "      goto L0;\n");
+    fprintf(out, "    return true;\n");
+    fprintf(out, "  }\n");
+  }
+    // fallthrough
+  case OP_CALL:
+    fprintf(out, "  vm.stack.top = slots + %d;\n", depth);
+    fprintf(out, "  AT(%d);\n", offset);
+    fprintf(out, "  if (!callCompiled(%d))\n", code[1]);
+    fprintf(out, "    return false;\n");
+    fprintf(out, "  RELOAD();\n");
+    break;
+  case OP_CLOSURE: {
+    ObjFunction* inner = AS_FUNCTION(chunk->constants.values[code[1]]);
+    fprintf(out, "  {\n");
+    fprintf(out, "    vm.stack.top = slots + %d;\n", depth);
+    fprintf(out,
+            "    ObjClosure* created = newClosure(AS_FUNCTION(constants[%d]));\n",
+            code[1]);
+    fprintf(out, "    slots[%d] = OBJ_VAL(created);\n", depth);
+    fprintf(out, "    vm.stack.top = slots + %d;\n", depth + 1);
+    for (int i = 0; i < inner->upvalueCount; i++) {
+      uint8_t kind = code[2 + 2 * i];
+      uint8_t index = code[3 + 2 * i];
+      if (kind == CAPTURE_LOCAL) {
+        fprintf(out,
+                "    created->upvalues[%d] = OBJ_VAL(captureValue(slots + %d));\n",
+                i, index);
+      } else if (kind == CAPTURE_VALUE) {
+        fprintf(out, "    created->upvalues[%d] = slots[%d];\n", i, index);
+      } else {
+        fprintf(out, "    created->upvalues[%d] = closure->upvalues[%d];\n", i,
+                index);
+      }
+      fprintf(out, "    writeBarrier((Obj*)created, created->upvalues[%d]);\n",
+              i);
+    }
+    fprintf(out, "  }\n");
+    break;
+  }
+  case OP_CLOSE_UPVALUES:
+    fprintf(out, "  closeUpvalues(slots + %d);\n", depth - code[1]);
+    break;
+  case OP_RETURN:
+    fprintf(out, "  return returnCompiled(slots, slots[%d]);\n", top);
+    break;
+  }
+}
+
+static void emitFunction(FILE* out, ObjFunction* function, int index) {
+  Chunk* chunk = &function->chunk;
+  int* depths = malloc(sizeof(int) * chunk->count);
+  bool* targets = calloc(chunk->count, sizeof(bool));
+  if (depths == NULL || targets == NULL)
+    exit(1);
+  stackDepths(chunk, function->arity, depths);
+  for (size_t offset = 0; offset < chunk->count;
+       offset += instructionLength(chunk, offset)) {
+    int target = jumpTarget(chunk, offset);
+    if (target >= 0)
+      targets[target] = true;
+    if (chunk->code[offset] == OP_TAIL_CALL)
+      targets[0] = true;
+  }
+
+  fprintf(out, "\n// %s\n", function->name == NULL ? "<script>"
+                                                   : function->name->chars);
+  fprintf(out, "static bool function%d(Value* slots) {\n", index);
+  fprintf(out, "  ObjClosure* closure = AS_CLOSURE(slots[0]);\n");
+  fprintf(out, "  int frameIndex = vm.frameCount - 1;\n");
+  fprintf(out, "  CallFrame* frame = &vm.frames[frameIndex];\n");
+  fprintf(out, "  uint8_t* code = closure->function->chunk.code;\n");
+  fprintf(out,
+          "  Value* constants = closure->function->chunk.constants.values;\n");
+  fprintf(out, "  (void)frame, (void)code, (void)constants;\n\n");
+
+  for (size_t offset = 0; offset < chunk->count;
+       offset += instructionLength(chunk, offset)) {
+    if (targets[offset])
+      fprintf(out, "L%zu:;\n", offset);
+    emitInstruction(out, function, index, offset, depths[offset]);
+  }
+  fprintf(out, "}\n");
+
+  free(depths);
+  free(targets);
+}
+
+// the loader rebuilds the ObjFunction, its bytecode is
+// only there for the line numbers of runtime errors.
+static void emitLoader(FILE* out, FunctionList* list, int index) {
+  ObjFunction* function = list->functions[index];
+  Chunk* chunk = &function->chunk;
+
+  fprintf(out, "\nstatic ObjFunction* load%d(void) {\n", index);
+  fprintf(out, "  static const uint8_t code[] = {");
+  for (size_t i = 0; i < chunk->count; i++) {
+    fprintf(out, "%s%d", i % 16 == 0 ? "\n      " : " ", chunk->code[i]);
+    if (i + 1 < chunk->count)
+      fputc(',', out);
+  }
+  fprintf(out, "};\n");
+  fprintf(out, "  static const int lines[] = {");
+  for (size_t i = 0; i < chunk->count; i++) {
+    fprintf(out, "%s%d", i % 16 == 0 ? "\n      " : " ", chunk->lines[i]);
+    if (i + 1 < chunk->count)
+      fputc(',', out);
+  }
+  fprintf(out, "};\n");
+
+  fprintf(out, "  ObjFunction* function = loadFunction(function%d, %d, %d, %d, ",
+          index, function->arity, function->maxStack, function->upvalueCount);
+  if (function->name == NULL) {
+    fprintf(out, "NULL");
+  } else {
+    printString(out, function->name->chars, function->name->length);
+  }
+  fprintf(out, ", code, lines, %zu);\n", chunk->count);
+
+  ValueArray* constants = &chunk->constants;
+  for (int i = 0; i < constants->count; i++) {
+    Value constant = constants->values[i];
+    fprintf(out, "  loadConstant(function, ");
+    if (IS_FUNCTION(constant)) {
+      fprintf(out, "OBJ_VAL(load%d())",
+              functionIndex(list, AS_FUNCTION(constant)));
+    } else if (IS_CLOSURE(constant)) {
+      // the one closure of a function that captures nothing,
+      // or of an OP_STACK_CLOSURE.
+      fprintf(out, "OBJ_VAL(newClosure(load%d()))",
+              functionIndex(list, AS_CLOSURE(constant)->function));
+    } else if (IS_STRING(constant)) {
+      ObjString* string = AS_STRING(constant);
+      fprintf(out, "OBJ_VAL(copyString(");
+      printString(out, string->chars, string->length);
+      fprintf(out, ", %d))", string->length);
+    } else {
+      printConstant(out, chunk, i);
+    }
+    fprintf(out, ");\n");
+  }
+  fprintf(out, "  return function;\n");
+  fprintf(out, "}\n");
+}
+
+bool emitC(ObjFunction* script, FILE* out) {
+  FunctionList list;
+  list.functions = NULL;
+  list.count = 0;
+  list.capacity = 0;
+  collectFunctions(&list, script);
+
+  fputs(prelude, out);
+  fprintf(out, "\n");
+  for (int i = 0; i < list.count; i++) {
+    fprintf(out, "static bool function%d(Value* slots);\n", i);
+    fprintf(out, "static ObjFunction* load%d(void);\n", i);
+  }
+  for (int i = 0; i < list.count; i++) {
+    emitFunction(out, list.functions[i], i);
+  }
+  for (int i = 0; i < list.count; i++) {
+    emitLoader(out, &list, i);
+  }
+
+  fprintf(out, "\nint main(void) {\n");
+  fprintf(out, "  initVM();\n");
+  fprintf(out, "  // the global slots the script was compiled with.\n");
+  for (int i = 0; i < vm.globalNames.count; i++) {
+    ObjString* name = AS_STRING(vm.globalNames.values[i]);
+    fprintf(out, "  declareGlobal(copyString(");
+    printString(out, name->chars, name->length);
+    fprintf(out, ", %d));\n", name->length);
+  }
+  fprintf(out, "  runCompiled(load0());\n");
+  fprintf(out, "  freeVM();\n");
+  fprintf(out, "  return 0;\n");
+  fprintf(out, "}\n");
+
+  free(list.functions);
+  return !ferror(out);
+}
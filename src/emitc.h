@@ -0,0 +1,25 @@
+#ifndef clox_emitc_h
+#define clox_emitc_h
+
+#include <stdio.h>
+
+#include "object.h"
+
+/*
+    clox --emit-c:
+    every function of a compiled script becomes a C function. the
+    values stay in the VM's stack slots, at the depths stackDepths()
+    gives, so the GC, upvalues and runtime errors work as they do in
+    the interpreter. each jump becomes a goto.
+
+    the generated unit has its own main() and links against the
+    runtime (libcloxrt, everything but main.c and emitc.c), e.g.
+      clox --emit-c script.c script.lox
+      cc -O2 -Isrc script.c libcloxrt.a -lpthread -o script
+*/
+
+// writes the C translation of "script" to "out". the global
+// slots the script was compiled with must still be in the VM.
+bool emitC(ObjFunction* script, FILE* out);
+
+#endif
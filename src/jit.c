@@ -0,0 +1,635 @@
+#include "jit.h"
+
+#ifdef JIT
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "vm.h"
+
+typedef enum {
+  RAX,
+  RCX,
+  RDX,
+  RBX,
+  RSP,
+  RBP,
+  RSI,
+  RDI,
+  R8,
+  R9,
+  R10,
+  R11,
+  R12,
+  R13,
+} Register;
+
+// the state native code keeps in callee-saved registers.
+#define SLOTS RBX    // the frame's first stack slot.
+#define CLOSURE R12  // the running closure.
+#define QNAN_REG R13 // QNAN, for the number checks.
+
+typedef enum {
+  CC_BE = 0x6,
+  CC_A = 0x7,
+  CC_E = 0x4,
+  CC_NP = 0xb,
+} Condition;
+
+// the ModRM.reg extensions of the SSE2 instructions used.
+#define SSE_ADD 0x58
+#define SSE_MUL 0x59
+#define SSE_SUB 0x5c
+#define SSE_DIV 0x5e
+
+// native code is "int entry(Value* slots, ObjClosure* closure,
+// uint8_t* target)", it starts running at "target" and returns
+// the offset of the instruction the interpreter continues at.
+typedef int (*JitEntry)(Value* slots, ObjClosure* closure, uint8_t* target);
+
+typedef struct {
+  uint8_t* code;
+  int count;
+  int capacity;
+
+  Chunk* chunk;
+  // the bytecode instruction being compiled.
+  int offset;
+  int* depths;
+  // the native offset of each bytecode instruction.
+  int* native;
+  int epilogue;
+  // (rel32 position, bytecode offset) pairs, of jumps to
+  // other instructions and of exits to the interpreter.
+  int* jumps;
+  int jumpCount;
+  int* exits;
+  int exitCount;
+} Assembler;
+
+// the buffers here are plain malloc() memory, compiling
+// a function never runs the GC.
+static void emitByte(Assembler* a, uint8_t byte) {
+  if (a->count + 1 > a->capacity) {
+    a->capacity = a->capacity < 256 ? 256 : a->capacity * 2;
+    a->code = realloc(a->code, a->capacity);
+    if (a->code == NULL)
+      exit(1);
+  }
+  a->code[a->count++] = byte;
+}
+
+static void emit32(Assembler* a, uint32_t value) {
+  for (int i = 0; i < 4; i++) {
+    emitByte(a, (value >> (8 * i)) & 0xff);
+  }
+}
+
+static void emit64(Assembler* a, uint64_t value) {
+  for (int i = 0; i < 8; i++) {
+    emitByte(a, (value >> (8 * i)) & 0xff);
+  }
+}
+
+static void rexW(Assembler* a, int reg, int rm) {
+  emitByte(a, 0x48 | (reg >> 3) << 2 | (rm >> 3));
+}
+
+// ModRM for [base + disp32], with the SIB byte that rsp and r12 need.
+static void memOperand(Assembler* a, int reg, int base, int32_t disp) {
+  emitByte(a, 0x80 | (reg & 7) << 3 | (base & 7));
+  if ((base & 7) == RSP)
+    emitByte(a, 0x24);
+  emit32(a, (uint32_t)disp);
+}
+
+// mov dst, [base + disp]
+static void load(Assembler* a, int dst, int base, int32_t disp) {
+  rexW(a, dst, base);
+  emitByte(a, 0x8b);
+  memOperand(a, dst, base, disp);
+}
+
+// mov [base + disp], src
+static void store(Assembler* a, int base, int32_t disp, int src) {
+  rexW(a, src, base);
+  emitByte(a, 0x89);
+  memOperand(a, src, base, disp);
+}
+
+// mov dst, imm64
+static void loadImmediate(Assembler* a, int dst, uint64_t value) {
+  emitByte(a, 0x48 | (dst >> 3));
+  emitByte(a, 0xb8 | (dst & 7));
+  emit64(a, value);
+}
+
+#define ALU_ADD 0x01
+#define ALU_OR 0x09
+#define ALU_AND 0x21
+#define ALU_XOR 0x31
+#define ALU_CMP 0x39
+#define ALU_MOV 0x89
+
+// <op> dst, src on 64 bit registers.
+static void alu(Assembler* a, uint8_t op, int dst, int src) {
+  rexW(a, src, dst);
+  emitByte(a, op);
+  emitByte(a, 0xc0 | (src & 7) << 3 | (dst & 7));
+}
+
+// movq xmm, reg
+static void toXmm(Assembler* a, int xmm, int reg) {
+  emitByte(a, 0x66);
+  rexW(a, xmm, reg);
+  emitByte(a, 0x0f);
+  emitByte(a, 0x6e);
+  emitByte(a, 0xc0 | xmm << 3 | (reg & 7));
+}
+
+// movq reg, xmm
+static void fromXmm(Assembler* a, int reg, int xmm) {
+  emitByte(a, 0x66);
+  rexW(a, xmm, reg);
+  emitByte(a, 0x0f);
+  emitByte(a, 0x7e);
+  emitByte(a, 0xc0 | xmm << 3 | (reg & 7));
+}
+
+// <op>sd xmm, xmm
+static void sse(Assembler* a, uint8_t op, int dst, int src) {
+  emitByte(a, 0xf2);
+  emitByte(a, 0x0f);
+  emitByte(a, op);
+  emitByte(a, 0xc0 | dst << 3 | src);
+}
+
+// ucomisd xmm, xmm
+static void ucomisd(Assembler* a, int left, int right) {
+  emitByte(a, 0x66);
+  emitByte(a, 0x0f);
+  emitByte(a, 0x2e);
+  emitByte(a, 0xc0 | left << 3 | right);
+}
+
+// set<cc> on al, cl, dl or bl.
+static void setcc(Assembler* a, Condition cc, int reg) {
+  emitByte(a, 0x0f);
+  emitByte(a, 0x90 | cc);
+  emitByte(a, 0xc0 | reg);
+}
+
+// j<cc> rel32, returns where the displacement goes.
+static int jcc(Assembler* a, Condition cc) {
+  emitByte(a, 0x0f);
+  emitByte(a, 0x80 | cc);
+  emit32(a, 0);
+  return a->count - 4;
+}
+
+// jmp rel32, returns where the displacement goes.
+static int jmp(Assembler* a) {
+  emitByte(a, 0xe9);
+  emit32(a, 0);
+  return a->count - 4;
+}
+
+static void patch(Assembler* a, int position, int target) {
+  uint32_t displacement = (uint32_t)(target - (position + 4));
+  memcpy(&a->code[position], &displacement, 4);
+}
+
+static int32_t slot(int index) { return (int32_t)(index * sizeof(Value)); }
+
+// jumps to the native code of bytecode instruction "target".
+static void jumpTo(Assembler* a, int position, int target) {
+  a->jumps[2 * a->jumpCount] = position;
+  a->jumps[2 * a->jumpCount + 1] = target;
+  a->jumpCount++;
+}
+
+// leaves the native code at the current instruction
+// if the flags satisfy "cc".
+static void exitIf(Assembler* a, Condition cc) {
+  a->exits[2 * a->exitCount] = jcc(a, cc);
+  a->exits[2 * a->exitCount + 1] = a->offset;
+  a->exitCount++;
+}
+
+// returns the current instruction to the interpreter.
+static void exitHere(Assembler* a) {
+  emitByte(a, 0xb8); // mov eax, imm32
+  emit32(a, (uint32_t)a->offset);
+  patch(a, jmp(a), a->epilogue);
+}
+
+// leaves the native code unless "reg" holds a number. clobbers rsi.
+static void guardNumber(Assembler* a, int reg) {
+  alu(a, ALU_MOV, RSI, reg);
+  alu(a, ALU_AND, RSI, QNAN_REG);
+  alu(a, ALU_CMP, RSI, QNAN_REG);
+  exitIf(a, CC_E);
+}
+
+// stores the bool in al to "index".
+static void storeBool(Assembler* a, int index) {
+  emitByte(a, 0x0f); // movzx eax, al
+  emitByte(a, 0xb6);
+  emitByte(a, 0xc0);
+  loadImmediate(a, RCX, FALSE_VAL);
+  alu(a, ALU_ADD, RAX, RCX); // TRUE_VAL is FALSE_VAL + 1
+  store(a, SLOTS, slot(index), RAX);
+}
+
+static void moveConstant(Assembler* a, int reg, int index) {
+  Value* constant = &a->chunk->constants.values[index];
+  if (IS_OBJ(*constant)) {
+    // read objects through the constant pool instead of
+    // putting their address in the code.
+    loadImmediate(a, reg, (uint64_t)(uintptr_t)constant);
+    load(a, reg, reg, 0);
+  } else {
+    loadImmediate(a, reg, *constant);
+  }
+}
+
+// loads two numbers into xmm0 and xmm1.
+static void loadNumbers(Assembler* a, int left, int right) {
+  guardNumber(a, left);
+  guardNumber(a, right);
+  toXmm(a, 0, left);
+  toXmm(a, 1, right);
+}
+
+// jumps to bytecode "target" if "reg" is falsey.
+static void jumpIfFalsey(Assembler* a, int reg, int target) {
+  loadImmediate(a, RCX, NIL_VAL);
+  alu(a, ALU_CMP, reg, RCX);
+  jumpTo(a, jcc(a, CC_E), target);
+  loadImmediate(a, RCX, FALSE_VAL);
+  alu(a, ALU_CMP, reg, RCX);
+  jumpTo(a, jcc(a, CC_E), target);
+}
+
+static void loadGlobals(Assembler* a, int reg) {
+  loadImmediate(a, reg, (uint64_t)(uintptr_t)&vm.globalValues.values);
+  load(a, reg, reg, 0);
+}
+
+// loads the address of upvalue "index"'s value.
+static void loadUpvalue(Assembler* a, int reg, int index) {
+  load(a, reg, CLOSURE, offsetof(ObjClosure, upvalues) + slot(index));
+  // the ObjUpvalue is boxed, clear the tag in the top bits.
+  rexW(a, 0, reg);
+  emitByte(a, 0xc1); // shl reg, 16
+  emitByte(a, 0xe0 | (reg & 7));
+  emitByte(a, 16);
+  rexW(a, 0, reg);
+  emitByte(a, 0xc1); // shr reg, 16
+  emitByte(a, 0xe8 | (reg & 7));
+  emitByte(a, 16);
+  load(a, reg, reg, offsetof(ObjUpvalue, slot));
+}
+
+// loads the slots of the frame below this one, the frame of the
+// function that declared the running stack closure. clobbers rax.
+static void loadEnclosingSlots(Assembler* a, int reg) {
+  loadImmediate(a, RAX, (uint64_t)(uintptr_t)&vm.frameCount);
+  emitByte(a, 0x48); // movsxd rax, dword [rax]
+  emitByte(a, 0x63);
+  emitByte(a, 0x00);
+  emitByte(a, 0x48); // imul rax, rax, sizeof(CallFrame)
+  emitByte(a, 0x69);
+  emitByte(a, 0xc0);
+  emit32(a, (uint32_t)sizeof(CallFrame));
+  loadImmediate(a, reg, (uint64_t)(uintptr_t)&vm.frames);
+  load(a, reg, reg, 0);
+  alu(a, ALU_ADD, reg, RAX);
+  load(a, reg, reg,
+       -2 * (int32_t)sizeof(CallFrame) + (int32_t)offsetof(CallFrame, slots));
+}
+
+static void printNative(Value value) {
+  printValue(value);
+  printf("\n");
+}
+
+static int readShort(uint8_t* code) { return (code[0] << 8) | code[1]; }
+
+static void compileInstruction(Assembler* a) {
+  uint8_t* code = &a->chunk->code[a->offset];
+  int depth = a->depths[a->offset];
+  int top = depth - 1;
+
+  switch (code[0]) {
+  case OP_CONSTANT:
+  case OP_STACK_CLOSURE:
+    moveConstant(a, RAX, code[1]);
+    store(a, SLOTS, slot(depth), RAX);
+    break;
+  case OP_NIL:
+  case OP_TRUE:
+  case OP_FALSE: {
+    Value value = code[0] == OP_NIL    ? NIL_VAL
+                  : code[0] == OP_TRUE ? TRUE_VAL
+                                       : FALSE_VAL;
+    loadImmediate(a, RAX, value);
+    store(a, SLOTS, slot(depth), RAX);
+    break;
+  }
+  case OP_POP:
+  case OP_POPN:
+    break;
+  case OP_GET_LOCAL:
+    load(a, RAX, SLOTS, slot(code[1]));
+    store(a, SLOTS, slot(depth), RAX);
+    break;
+  case OP_SET_LOCAL:
+  case OP_SET_LOCAL_POP:
+    load(a, RAX, SLOTS, slot(top));
+    store(a, SLOTS, slot(code[1]), RAX);
+    break;
+  case OP_ADD:
+  case OP_SUB:
+  case OP_MULT:
+  case OP_DIV:
+  case OP_ADD_LOCALS: {
+    int left = code[0] == OP_ADD_LOCALS ? code[1] : top - 1;
+    int right = code[0] == OP_ADD_LOCALS ? code[2] : top;
+    int result = code[0] == OP_ADD_LOCALS ? depth : top - 1;
+    uint8_t op = code[0] == OP_SUB    ? SSE_SUB
+                 : code[0] == OP_MULT ? SSE_MUL
+                 : code[0] == OP_DIV  ? SSE_DIV
+                                      : SSE_ADD;
+    load(a, RAX, SLOTS, slot(left));
+    load(a, RCX, SLOTS, slot(right));
+    loadNumbers(a, RAX, RCX);
+    sse(a, op, 0, 1);
+    fromXmm(a, RAX, 0);
+    store(a, SLOTS, slot(result), RAX);
+    break;
+  }
+  case OP_LESS:
+  case OP_GREATER:
+    load(a, RAX, SLOTS, slot(top - 1));
+    load(a, RCX, SLOTS, slot(top));
+    loadNumbers(a, RAX, RCX);
+    // "above" is false for NaN operands.
+    if (code[0] == OP_LESS) {
+      ucomisd(a, 1, 0);
+    } else {
+      ucomisd(a, 0, 1);
+    }
+    setcc(a, CC_A, RAX);
+    storeBool(a, top - 1);
+    break;
+  case OP_EQUAL:
+  case OP_NOT_EQUAL: {
+    // numbers compare as doubles, everything else by identity.
+    load(a, RAX, SLOTS, slot(top - 1));
+    load(a, RCX, SLOTS, slot(top));
+    alu(a, ALU_MOV, RSI, RAX);
+    alu(a, ALU_AND, RSI, QNAN_REG);
+    alu(a, ALU_CMP, RSI, QNAN_REG);
+    int leftNotNumber = jcc(a, CC_E);
+    alu(a, ALU_MOV, RSI, RCX);
+    alu(a, ALU_AND, RSI, QNAN_REG);
+    alu(a, ALU_CMP, RSI, QNAN_REG);
+    int rightNotNumber = jcc(a, CC_E);
+    toXmm(a, 0, RAX);
+    toXmm(a, 1, RCX);
+    ucomisd(a, 0, 1);
+    setcc(a, CC_E, RAX);
+    setcc(a, CC_NP, RCX);
+    emitByte(a, 0x20); // and al, cl
+    emitByte(a, 0xc8);
+    int done = jmp(a);
+    patch(a, leftNotNumber, a->count);
+    patch(a, rightNotNumber, a->count);
+    alu(a, ALU_CMP, RAX, RCX);
+    setcc(a, CC_E, RAX);
+    patch(a, done, a->count);
+    if (code[0] == OP_NOT_EQUAL) {
+      emitByte(a, 0x34); // xor al, 1
+      emitByte(a, 0x01);
+    }
+    storeBool(a, top - 1);
+    break;
+  }
+  case OP_NOT:
+    load(a, RAX, SLOTS, slot(top));
+    loadImmediate(a, RCX, NIL_VAL);
+    alu(a, ALU_CMP, RAX, RCX);
+    setcc(a, CC_E, RDX);
+    loadImmediate(a, RCX, FALSE_VAL);
+    alu(a, ALU_CMP, RAX, RCX);
+    setcc(a, CC_E, RAX);
+    emitByte(a, 0x08); // or al, dl
+    emitByte(a, 0xd0);
+    storeBool(a, top);
+    break;
+  case OP_NEGATE:
+    load(a, RAX, SLOTS, slot(top));
+    guardNumber(a, RAX);
+    loadImmediate(a, RCX, SIGN_BIT);
+    alu(a, ALU_XOR, RAX, RCX);
+    store(a, SLOTS, slot(top), RAX);
+    break;
+  case OP_PRINT:
+    load(a, RDI, SLOTS, slot(top));
+    loadImmediate(a, RAX, (uint64_t)(uintptr_t)printNative);
+    emitByte(a, 0xff); // call rax
+    emitByte(a, 0xd0);
+    break;
+  case OP_GET_GLOBAL:
+    loadGlobals(a, RAX);
+    load(a, RAX, RAX, slot(readShort(code + 1)));
+    loadImmediate(a, RCX, UNDEFINED_VAL);
+    alu(a, ALU_CMP, RAX, RCX);
+    exitIf(a, CC_E);
+    store(a, SLOTS, slot(depth), RAX);
+    break;
+  case OP_SET_GLOBAL:
+    loadGlobals(a, RDX);
+    load(a, RAX, RDX, slot(readShort(code + 1)));
+    loadImmediate(a, RCX, UNDEFINED_VAL);
+    alu(a, ALU_CMP, RAX, RCX);
+    exitIf(a, CC_E);
+    load(a, RAX, SLOTS, slot(top));
+    store(a, RDX, slot(readShort(code + 1)), RAX);
+    break;
+  case OP_DEFINE_GLOBAL:
+    loadGlobals(a, RDX);
+    load(a, RAX, SLOTS, slot(top));
+    store(a, RDX, slot(readShort(code + 1)), RAX);
+    break;
+  case OP_GET_UPVALUE:
+    loadUpvalue(a, RAX, code[1]);
+    load(a, RAX, RAX, 0);
+    store(a, SLOTS, slot(depth), RAX);
+    break;
+  case OP_GET_FLAT_UPVALUE:
+    load(a, RAX, CLOSURE, offsetof(ObjClosure, upvalues) + slot(code[1]));
+    store(a, SLOTS, slot(depth), RAX);
+    break;
+  case OP_SET_UPVALUE:
+    load(a, RAX, SLOTS, slot(top));
+    // the interpreter has the write barriers: it stores the objects
+    // and whatever replaces one.
+    loadImmediate(a, RCX, SIGN_BIT | QNAN);
+    alu(a, ALU_MOV, RSI, RAX);
+    alu(a, ALU_AND, RSI, RCX);
+    alu(a, ALU_CMP, RSI, RCX);
+    exitIf(a, CC_E);
+    loadUpvalue(a, RDX, code[1]);
+    load(a, RSI, RDX, 0);
+    alu(a, ALU_AND, RSI, RCX);
+    alu(a, ALU_CMP, RSI, RCX);
+    exitIf(a, CC_E);
+    store(a, RDX, 0, RAX);
+    break;
+  case OP_GET_ENCLOSING:
+    loadEnclosingSlots(a, RDX);
+    load(a, RAX, RDX, slot(code[1]));
+    store(a, SLOTS, slot(depth), RAX);
+    break;
+  case OP_SET_ENCLOSING:
+    loadEnclosingSlots(a, RDX);
+    load(a, RAX, SLOTS, slot(top));
+    store(a, RDX, slot(code[1]), RAX);
+    break;
+  case OP_JUMP:
+  case OP_LOOP:
+    jumpTo(a, jmp(a), jumpTarget(a->chunk, a->offset));
+    break;
+  case OP_JUMPZ:
+  case OP_POP_JUMPZ:
+    load(a, RAX, SLOTS, slot(top));
+    jumpIfFalsey(a, RAX, jumpTarget(a->chunk, a->offset));
+    break;
+  case OP_LESS_LOCAL_CONST_JUMPZ:
+    load(a, RAX, SLOTS, slot(code[1]));
+    moveConstant(a, RCX, code[2]);
+    loadNumbers(a, RAX, RCX);
+    // jump unless local < constant, NaN included.
+    ucomisd(a, 1, 0);
+    jumpTo(a, jcc(a, CC_BE), jumpTarget(a->chunk, a->offset));
+    break;
+  default:
+    // OP_CALL, OP_TAIL_CALL, OP_RETURN, OP_CLOSURE
+    // and OP_CLOSE_UPVALUES.
+    exitHere(a);
+    break;
+  }
+}
+
+bool compileJit(ObjFunction* function) {
+  Chunk* chunk = &function->chunk;
+  Assembler a;
+  a.code = NULL;
+  a.count = 0;
+  a.capacity = 0;
+  a.chunk = chunk;
+  a.depths = malloc(sizeof(int) * chunk->count);
+  a.native = malloc(sizeof(int) * chunk->count);
+  // at most two jumps, or two exits, per instruction.
+  a.jumps = malloc(sizeof(int) * 4 * chunk->count);
+  a.exits = malloc(sizeof(int) * 4 * chunk->count);
+  a.jumpCount = 0;
+  a.exitCount = 0;
+  stackDepths(chunk, function->arity, a.depths);
+
+  // prologue: save the callee-saved registers (which also aligns
+  // the stack for calls), set up the state and jump to "target".
+  static const uint8_t pushes[] = {0x53, 0x41, 0x54, 0x41, 0x55};
+  for (size_t i = 0; i < sizeof(pushes); i++) {
+    emitByte(&a, pushes[i]); // push rbx, push r12, push r13
+  }
+  alu(&a, ALU_MOV, SLOTS, RDI);
+  alu(&a, ALU_MOV, CLOSURE, RSI);
+  loadImmediate(&a, QNAN_REG, QNAN);
+  emitByte(&a, 0xff); // jmp rdx
+  emitByte(&a, 0xe2);
+
+  a.epilogue = a.count;
+  static const uint8_t pops[] = {0x41, 0x5d, 0x41, 0x5c, 0x5b, 0xc3};
+  for (size_t i = 0; i < sizeof(pops); i++) {
+    emitByte(&a, pops[i]); // pop r13, pop r12, pop rbx, ret
+  }
+
+  for (int offset = 0; offset < chunk->count; offset++) {
+    a.native[offset] = -1;
+  }
+  for (a.offset = 0; a.offset < chunk->count;
+       a.offset += instructionLength(chunk, a.offset)) {
+    a.native[a.offset] = a.count;
+    compileInstruction(&a);
+  }
+
+  for (int i = 0; i < a.jumpCount; i++) {
+    patch(&a, a.jumps[2 * i], a.native[a.jumps[2 * i + 1]]);
+  }
+  // one exit stub per instruction that can leave.
+  int* stubOffsets = malloc(sizeof(int) * chunk->count);
+  for (int offset = 0; offset < chunk->count; offset++) {
+    stubOffsets[offset] = -1;
+  }
+  for (int i = 0; i < a.exitCount; i++) {
+    int offset = a.exits[2 * i + 1];
+    if (stubOffsets[offset] < 0) {
+      stubOffsets[offset] = a.count;
+      a.offset = offset;
+      exitHere(&a);
+    }
+    patch(&a, a.exits[2 * i], stubOffsets[offset]);
+  }
+  free(stubOffsets);
+
+  uint8_t* memory = mmap(NULL, a.count, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  bool mapped = memory != MAP_FAILED;
+  if (mapped) {
+    memcpy(memory, a.code, a.count);
+    mapped = mprotect(memory, a.count, PROT_READ | PROT_EXEC) == 0;
+    if (!mapped)
+      munmap(memory, a.count);
+  }
+
+  if (mapped) {
+    JitCode* jit = malloc(sizeof(JitCode));
+    jit->code = memory;
+    jit->size = a.count;
+    jit->entries = malloc(sizeof(uint8_t*) * chunk->count);
+    for (int offset = 0; offset < chunk->count; offset++) {
+      jit->entries[offset] =
+          a.native[offset] >= 0 ? memory + a.native[offset] : NULL;
+    }
+    jit->depths = a.depths;
+    function->jit = jit;
+  } else {
+    free(a.depths);
+  }
+
+  free(a.code);
+  free(a.native);
+  free(a.jumps);
+  free(a.exits);
+  return mapped;
+}
+
+void freeJit(JitCode* jit) {
+  munmap(jit->code, jit->size);
+  free(jit->entries);
+  free(jit->depths);
+  free(jit);
+}
+
+int runJit(ObjClosure* closure, Value* slots, int offset) {
+  JitCode* jit = closure->function->jit;
+  return ((JitEntry)jit->code)(slots, closure, jit->entries[offset]);
+}
+
+#endif
@@ -0,0 +1,43 @@
+#ifndef clox_jit_h
+#define clox_jit_h
+
+#include "common.h"
+#include "object.h"
+
+// how many calls plus loop back-edges a function
+// runs in the interpreter before it is compiled.
+#define JIT_THRESHOLD 1000
+
+/*
+    JIT:
+    a hot function's bytecode is compiled to x86-64 machine code,
+    one template per opcode. the native code works on the same
+    frame as the interpreter: every value stays in its stack slot
+    at the depth the bytecode has it at, so the interpreter can
+    take over at any instruction.
+
+    native code never allocates and never calls back into the
+    interpreter. calls, returns, closures, and every operation
+    whose operands fail a type guard (a string +, an undefined
+    global) leave the native code: it returns the offset of that
+    instruction and the interpreter runs it. the interpreter goes
+    back into native code after calls return and at loop
+    back-edges.
+*/
+
+struct sJitCode {
+  // the executable mapping.
+  uint8_t* code;
+  size_t size;
+  // the native address of each bytecode instruction,
+  // NULL where no instruction starts.
+  uint8_t** entries;
+  // the stack depth before each instruction (stackDepths()).
+  int* depths;
+};
+
+bool compileJit(ObjFunction* function);
+void freeJit(JitCode* jit);
+int runJit(ObjClosure* closure, Value* slots, int offset);
+
+#endif
@@ -5,6 +5,7 @@
 #include "chunk.h"
 #include "compiler.h"
 #include "debug.h"
+#include "emitc.h"
 #include "vm.h"
 
 void chunkTest() {
@@ -37,8 +38,7 @@ static void repl() {
 }
 
 static char* readFile(const char* filePath) {
-  FILE* file;
-  fopen_s(&file, filePath, "r");
+  FILE* file = fopen(filePath, "r");
 
   if (!file) {
     fprintf(stderr, "Could not open file \'%s\'\n", filePath);
@@ -70,16 +70,93 @@ static void runFile(const char* filePath) {
   interpret(sourceCode);
 }
 
+// writes the script at "filePath" as C to "outPath" (see emitc.h).
+static void emitFile(const char* filePath, const char* outPath) {
+  char* sourceCode = readFile(filePath);
+  ObjFunction* function = compile(sourceCode);
+  free(sourceCode);
+  if (function == NULL)
+    exit(65);
+
+  FILE* out = fopen(outPath, "w");
+  if (!out) {
+    fprintf(stderr, "Could not open file \'%s\'\n", outPath);
+    exit(EXIT_FAILURE);
+  }
+  bool written = emitC(function, out);
+  if (fclose(out) != 0 || !written) {
+    fprintf(stderr, "Couldn't write file \'%s\'.\n", outPath);
+    exit(EXIT_FAILURE);
+  }
+}
+
 static void runLox(int argc, char const* argv[]) {
   initVM();
   printf("cLox | Crafting Interpreters (Bob Nystrom).\n");
 
-  if (argc == 1) {
+  // --register runs the script on the register VM,
+  // --no-jit keeps every function in the interpreter,
+  // --emit-c <file> translates the script to C instead,
+  // --max-depth <n> limits how deep calls can nest,
+  // --gc-growth <factor> sets how much the heap grows between
+  // collections, --gc-incremental marks in steps of at most
+  // --gc-step <n> objects, --gc-threads <n> marks on n threads,
+  // --gc-concurrent marks on a thread of its own while the script runs,
+  // --gc-compact <fraction> compacts the heap once that much of it
+  // could be released.
+  const char* path = NULL;
+  const char* emitPath = NULL;
+  int pathCount = 0;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--emit-c") == 0 && i + 1 < argc) {
+      emitPath = argv[++i];
+    } else if (strcmp(argv[i], "--max-depth") == 0 && i + 1 < argc) {
+      int depth = atoi(argv[++i]);
+      if (depth > 0)
+        vm.maxFrames = depth;
+    } else if (strcmp(argv[i], "--gc-growth") == 0 && i + 1 < argc) {
+      double factor = atof(argv[++i]);
+      if (factor > 1)
+        vm.heapGrowFactor = factor;
+    } else if (strcmp(argv[i], "--gc-incremental") == 0) {
+      vm.gcIncremental = true;
+    } else if (strcmp(argv[i], "--gc-step") == 0 && i + 1 < argc) {
+      int objects = atoi(argv[++i]);
+      if (objects > 0)
+        vm.gcStepObjects = objects;
+    } else if (strcmp(argv[i], "--gc-threads") == 0 && i + 1 < argc) {
+      int threads = atoi(argv[++i]);
+      if (threads > 0)
+        vm.gcThreads = threads;
+    } else if (strcmp(argv[i], "--gc-concurrent") == 0) {
+      vm.gcConcurrent = true;
+    } else if (strcmp(argv[i], "--gc-compact") == 0 && i + 1 < argc) {
+      double fraction = atof(argv[++i]);
+      if (fraction > 0 && fraction < 1)
+        vm.compactThreshold = fraction;
+    } else if (strcmp(argv[i], "--register") == 0) {
+      vm.registerMode = true;
+      vm.jitEnabled = false;
+    } else if (strcmp(argv[i], "--no-jit") == 0) {
+      vm.jitEnabled = false;
+    } else {
+      path = argv[i];
+      pathCount++;
+    }
+  }
+
+  if (pathCount == 1 && emitPath != NULL) {
+    emitFile(path, emitPath);
+  } else if (pathCount == 0 && emitPath == NULL) {
     repl();
-  } else if (argc == 2) {
-    runFile(argv[1]);
+  } else if (pathCount == 1) {
+    runFile(path);
   } else {
-    fprintf(stderr, "Usage: clox [path].\n");
+    fprintf(stderr, "Usage: clox [--register] [--no-jit] [--max-depth n] "
+                    "[--gc-growth factor] [--gc-incremental] "
+                    "[--gc-step n] [--gc-threads n] [--gc-concurrent] "
+                    "[--gc-compact fraction] [path].\n"
+                    "       clox --emit-c <out.c> <path>.\n");
   }
 
   freeVM();
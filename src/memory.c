@@ -1,7 +1,10 @@
 #include "memory.h"
 #include "common.h"
 #include <stdlib.h>
+#include <string.h>
 
+#include "compiler.h"
+#include "jit.h"
 #include "object.h"
 #include "vm.h"
 
@@ -10,11 +13,59 @@
 #include <stdio.h>
 #endif
 
-void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
-  if (newSize > oldSize) {
+#ifdef PARALLEL_GC
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+static void gcStep();
+
+#ifdef PARALLEL_GC
+// set while the marker thread works on the cycle.
+static bool concurrentCycle;
+static bool handOver();
+static void pauseMarker();
+#endif
+
+// a concurrent cycle only starts while a script runs, see memory.h.
+static bool markConcurrently() {
+#ifdef PARALLEL_GC
+  return vm.gcConcurrent && vm.frameCount > 0;
+#else
+  return false;
+#endif
+}
+
+// called before "size" new bytes are allocated.
+static void collectIfNeeded(size_t size) {
 #ifdef DEBUG_STRESS_GC
+  (void)size;
+  if (vm.gcIncremental || markConcurrently()) {
+    gcStep();
+  } else {
     collectGarbage();
+  }
+#else
+  if (vm.gcPhase == GC_MARKING) {
+    vm.gcStepDebt += size;
+    if (vm.gcStepDebt >= GC_STEP_BYTES) {
+      vm.gcStepDebt = 0;
+      gcStep();
+    }
+  } else if (vm.bytesAllocated > vm.nextGC) {
+    if (vm.gcIncremental || markConcurrently()) {
+      gcStep();
+    } else {
+      collectGarbage();
+    }
+  }
 #endif
+}
+
+void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
+  vm.bytesAllocated += newSize - oldSize;
+  if (newSize > oldSize) {
+    collectIfNeeded(newSize - oldSize);
   }
 
   if (newSize == 0) {
@@ -32,45 +83,74 @@ static void freeObject(Obj* object) {
   switch (object->type) {
   case OBJ_STRING: {
     ObjString* string = (ObjString*)object;
-    FREE(ObjString, string);
+    freeOld(object, STRING_SIZE(string->length));
     break;
   }
 
   case OBJ_FUNCTION: {
     ObjFunction* func = (ObjFunction*)object;
     freeChunk(&func->chunk);
-    FREE(ObjFunction, object);
+    freeRegChunk(&func->registerCode);
+#ifdef JIT
+    if (func->jit != NULL)
+      freeJit(func->jit);
+#endif
+    freeOld(object, sizeof(ObjFunction));
     break;
   }
 
   case OBJ_NATIVE:
-    FREE(ObjNative, object);
+    freeOld(object, sizeof(ObjNative));
     break;
 
   case OBJ_CLOSURE:
-    ObjClosure* closure = (ObjClosure*)object;
-    FREE_ARRAY(closure->upvalues, ObjUpvalue*, closure->upvalueCount);
-    FREE(ObjClosure, object);
+    freeOld(object, CLOSURE_SIZE(((ObjClosure*)object)->upvalueCount));
     break;
 
   case OBJ_UPVALUE:
-    FREE(ObjUpvalue, object);
+    freeOld(object, sizeof(ObjUpvalue));
     break;
   default:
     break;
   }
 }
 
+static void freePage(Page* page);
+
 void freeObjects() {
-  Obj* object = vm.objects;
-  while (object != NULL) {
-    Obj* next = object->next;
-    freeObject(object);
-    object = next;
+  for (int i = 0; i < SLAB_CLASSES; i++) {
+    Page* page = vm.pages[i];
+    while (page != NULL) {
+      Page* next = page->next;
+      for (int word = 0; word < SLAB_SLOTS / 64; word++) {
+        for (uint64_t used = page->used[word]; used != 0; used &= used - 1) {
+          int bit = word * 64 + __builtin_ctzll(used);
+          freeObject((Obj*)((uint8_t*)page + bit * 16));
+        }
+      }
+      freePage(page);
+      page = next;
+    }
+    vm.pages[i] = NULL;
+    vm.available[i] = NULL;
   }
+  while (vm.sparePages != NULL) {
+    Page* next = vm.sparePages->next;
+    freePage(vm.sparePages);
+    vm.sparePages = next;
+  }
+  vm.spareCount = 0;
+
+  for (int i = 0; i < vm.objectCount; i++) {
+    freeObject(vm.objects[i]);
+  }
+  free(vm.objects);
 }
 
 static void markArray();
+#ifdef PARALLEL_GC
+static void traceParallel();
+#endif
 
 static void blackenObject(Obj* object) {
 #ifdef DEBUG_LOG_GC
@@ -96,7 +176,7 @@ static void blackenObject(Obj* object) {
     ObjClosure* closure = (ObjClosure*)object;
     markObject((Obj*)closure->function);
     for (int i = 0; i < closure->upvalueCount; i++) {
-      markObject((Obj*)closure->upvalues[i]);
+      markValue(closure->upvalues[i]);
     }
     break;
   }
@@ -110,13 +190,17 @@ static void markRoots() {
     markValue(*slot);
   }
 
+  markArray(&vm.globalValues);
+  markArray(&vm.globalNames);
+  markTable(&vm.globalSlots);
+  markCompilerRoots();
+
   for (int i = 0; i < vm.frameCount; i++) {
     markObject((Obj*)vm.frames[i].closure);
   }
 
-  for (ObjUpvalue* upval = vm.openUpvalues; upval != NULL;
-       upval = upval->next) {
-    markObject((Obj*)upval);
+  for (int i = 0; i < vm.openTop; i++) {
+    markObject((Obj*)vm.openUpvalues[i]);
   }
 }
 
@@ -127,22 +211,452 @@ static void traceRefs() {
   }
 }
 
+// the old objects that point into the nursery keep the young
+// objects alive, which may in turn keep old ones alive.
+static void markRemembered() {
+  for (int i = 0; i < vm.rememberedCount; i++) {
+    blackenObject(vm.remembered[i]);
+  }
+}
+
 static void markArray(ValueArray* array) {
   for (int i = 0; i < array->count; i++) {
     markValue(array->values[i]);
   }
 }
 
-void collectGarbage() {
+static void sweepSlabs();
+
+// frees every object the trace didn't reach
+// and clears the marks for the next collection.
+static void sweep() {
+  sweepSlabs();
+
+  int count = 0;
+  for (int i = 0; i < vm.objectCount; i++) {
+    Obj* object = vm.objects[i];
+    if (object->isMarked) {
+      object->isMarked = false;
+      vm.objects[count++] = object;
+    } else {
+      freeObject(object);
+    }
+  }
+  vm.objectCount = count;
+}
+
+static void walkNursery(void (*visit)(Obj* object));
+
+static void clearMark(Obj* object) { object->isMarked = false; }
+
+// drops the remembered objects the sweep is about to free.
+static void pruneRemembered() {
+  int count = 0;
+  for (int i = 0; i < vm.rememberedCount; i++) {
+    if (isMarked(vm.remembered[i]))
+      vm.remembered[count++] = vm.remembered[i];
+  }
+  vm.rememberedCount = count;
+}
+
+// marks whatever is left and frees the rest. when the marking was
+// done in steps, the roots weren't behind a write barrier and the
+// young objects were skipped: both are traced again here.
+static void finishCycle() {
 #ifdef DEBUG_LOG_GC
-  printf("-- gc begin\n");
+  size_t before = vm.bytesAllocated;
 #endif
 
+#ifdef PARALLEL_GC
+  if (concurrentCycle) {
+    pauseMarker();
+    concurrentCycle = false;
+  }
+#endif
+  vm.gcPhase = GC_FINISHING;
   markRoots();
+  markRemembered();
+#ifdef PARALLEL_GC
+  if (vm.gcThreads > 1 && vm.bytesAllocated >= GC_PARALLEL_MIN) {
+    traceParallel();
+  } else {
+    traceRefs();
+  }
+#else
   traceRefs();
+#endif
+  // the intern table doesn't keep strings alive, drop the
+  // ones about to be freed before the sweep.
+  tableRemoveWhite(&vm.strings);
+  pruneRemembered();
+  sweep();
+  // the sweep only sees the old heap, the young objects
+  // were traced as well and stay where they are.
+  walkNursery(clearMark);
+
+  vm.nextGC = (size_t)(vm.bytesAllocated * vm.heapGrowFactor);
+  if (vm.nextGC < GC_HEAP_MIN)
+    vm.nextGC = GC_HEAP_MIN;
+  vm.gcPhase = GC_IDLE;
+
+#ifdef DEBUG_LOG_GC
+  printf("   collected %zu bytes (from %zu to %zu) next at %zu\n",
+         before - vm.bytesAllocated, before, vm.bytesAllocated, vm.nextGC);
+#endif
+}
+
+void collectGarbage() {
+#ifdef DEBUG_LOG_GC
+  printf("-- gc begin\n");
+#endif
+
+  finishCycle();
+
+#ifdef DEBUG_LOG_GC
+  printf("-- gc end\n");
+#endif
+}
+
+// one increment of an incremental collection (clox --gc-incremental):
+// the first one marks the roots, then each one blackens up to
+// vm.gcStepObjects gray objects. the last one finishes the cycle.
+static void gcStep() {
+  if (vm.gcPhase == GC_IDLE) {
+#ifdef DEBUG_LOG_GC
+    printf("-- gc cycle begin\n");
+#endif
+    vm.gcPhase = GC_MARKING;
+    vm.gcStepDebt = 0;
+    markRoots();
+#ifdef PARALLEL_GC
+    concurrentCycle = markConcurrently();
+    if (concurrentCycle)
+      handOver();
+#endif
+    return;
+  }
 
+#ifdef PARALLEL_GC
+  // if the script allocates faster than the marker thread marks,
+  // the rest is marked here.
+  if (concurrentCycle) {
+    if (handOver() || vm.bytesAllocated > 2 * vm.nextGC) {
+      finishCycle();
 #ifdef DEBUG_LOG_GC
-  printf("\n-- gc end\n");
+      printf("-- gc cycle end\n");
+#endif
+    }
+    return;
+  }
+#endif
+
+  for (int i = 0; i < vm.gcStepObjects && vm.grayCount > 0; i++) {
+    blackenObject(vm.grayStack[--vm.grayCount]);
+  }
+  if (vm.grayCount == 0) {
+    finishCycle();
+#ifdef DEBUG_LOG_GC
+    printf("-- gc cycle end\n");
+#endif
+  }
+}
+
+static void pushGray(Obj* object) {
+  if (vm.grayCapacity < vm.grayCount + 1) {
+    vm.grayCapacity = GROW_CAPACITY(vm.grayCapacity);
+    vm.grayStack = realloc(vm.grayStack, sizeof(Obj*) * vm.grayCapacity);
+    if (vm.grayStack == NULL)
+      exit(1);
+  }
+  vm.grayStack[vm.grayCount++] = object;
+}
+
+#ifdef PARALLEL_GC
+
+// a marking thread's gray objects. it works off its own stack
+// without locking, and moves some of it to the shared one, where
+// the other threads can steal from, when one of them is idle.
+typedef struct {
+  Obj** stack;
+  int count;
+  int capacity;
+  pthread_mutex_t lock;
+  Obj** shared;
+  int sharedCount;
+  int sharedCapacity;
+  pthread_t thread;
+} Marker;
+
+#define SHARE_MIN 16
+#define STEAL_MAX 64
+
+static Marker* markers;
+static int markerCount;
+static int idleMarkers;
+// the marker of the current thread, NULL when marking serially.
+static _Thread_local Marker* marker;
+
+static void growStack(Obj*** stack, int* capacity, int count) {
+  if (*capacity < count) {
+    while (*capacity < count) {
+      *capacity = GROW_CAPACITY(*capacity);
+    }
+    *stack = realloc(*stack, sizeof(Obj*) * *capacity);
+    if (*stack == NULL)
+      exit(1);
+  }
+}
+
+// moves objects between a marker's shared stack and "objects".
+// the other threads read the shared count without the lock.
+static void share(Marker* m, Obj** objects, int count) {
+  pthread_mutex_lock(&m->lock);
+  growStack(&m->shared, &m->sharedCapacity, m->sharedCount + count);
+  memcpy(&m->shared[m->sharedCount], objects, sizeof(Obj*) * count);
+  __atomic_store_n(&m->sharedCount, m->sharedCount + count,
+                   __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&m->lock);
+}
+
+static int take(Marker* m, Obj** objects, int max) {
+  pthread_mutex_lock(&m->lock);
+  int count = (m->sharedCount + 1) / 2;
+  if (count > max)
+    count = max;
+  memcpy(objects, &m->shared[m->sharedCount - count], sizeof(Obj*) * count);
+  __atomic_store_n(&m->sharedCount, m->sharedCount - count,
+                   __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&m->lock);
+  return count;
+}
+
+static void markerPush(Marker* m, Obj* object) {
+  growStack(&m->stack, &m->capacity, m->count + 1);
+  m->stack[m->count++] = object;
+
+  if (m->count >= SHARE_MIN &&
+      __atomic_load_n(&idleMarkers, __ATOMIC_RELAXED) > 0 &&
+      __atomic_load_n(&m->sharedCount, __ATOMIC_RELAXED) == 0) {
+    int half = m->count / 2;
+    m->count -= half;
+    share(m, &m->stack[m->count], half);
+  }
+}
+
+static Obj* markerPop(Marker* m) {
+  if (m->count == 0 &&
+      __atomic_load_n(&m->sharedCount, __ATOMIC_RELAXED) > 0) {
+    growStack(&m->stack, &m->capacity, STEAL_MAX);
+    m->count = take(m, m->stack, STEAL_MAX);
+  }
+  return m->count > 0 ? m->stack[--m->count] : NULL;
+}
+
+// takes up to half of another marker's shared objects.
+static bool steal(Marker* m) {
+  for (int i = 1; i < markerCount; i++) {
+    Marker* victim = &markers[(m - markers + i) % markerCount];
+    if (__atomic_load_n(&victim->sharedCount, __ATOMIC_RELAXED) == 0)
+      continue;
+    growStack(&m->stack, &m->capacity, STEAL_MAX);
+    m->count = take(victim, m->stack, STEAL_MAX);
+    if (m->count > 0)
+      return true;
+  }
+  return false;
+}
+
+static bool anyShared() {
+  for (int i = 0; i < markerCount; i++) {
+    if (__atomic_load_n(&markers[i].sharedCount, __ATOMIC_RELAXED) > 0)
+      return true;
+  }
+  return false;
+}
+
+// runs until every marker is out of gray objects. a thread only
+// goes idle with both of its stacks empty and nobody else fills
+// them, so once all of them are idle there is nothing left to mark.
+static void* markLoop(void* arg) {
+  marker = (Marker*)arg;
+  for (;;) {
+    Obj* object;
+    while ((object = markerPop(marker)) != NULL) {
+      blackenObject(object);
+    }
+    if (steal(marker))
+      continue;
+
+    __atomic_add_fetch(&idleMarkers, 1, __ATOMIC_SEQ_CST);
+    for (;;) {
+      if (__atomic_load_n(&idleMarkers, __ATOMIC_SEQ_CST) == markerCount)
+        goto done;
+      if (anyShared()) {
+        __atomic_sub_fetch(&idleMarkers, 1, __ATOMIC_SEQ_CST);
+        break;
+      }
+      sched_yield();
+    }
+  }
+
+done:
+  marker = NULL;
+  return NULL;
+}
+
+// traceRefs() on vm.gcThreads threads (clox --gc-threads <n>), the
+// calling one included. the mark bits are set atomically, so every
+// object is blackened once and the live set is the serial one.
+static void traceParallel() {
+  markerCount = vm.gcThreads;
+  markers = calloc(markerCount, sizeof(Marker));
+  if (markers == NULL)
+    exit(1);
+  for (int i = 0; i < markerCount; i++) {
+    pthread_mutex_init(&markers[i].lock, NULL);
+  }
+  // deal out the roots.
+  for (int i = 0; i < vm.grayCount; i++) {
+    Marker* m = &markers[i % markerCount];
+    growStack(&m->stack, &m->capacity, m->count + 1);
+    m->stack[m->count++] = vm.grayStack[i];
+  }
+  vm.grayCount = 0;
+  idleMarkers = 0;
+
+  for (int i = 1; i < markerCount; i++) {
+    if (pthread_create(&markers[i].thread, NULL, markLoop, &markers[i]) != 0)
+      exit(1);
+  }
+  markLoop(&markers[0]);
+  for (int i = 1; i < markerCount; i++) {
+    pthread_join(markers[i].thread, NULL);
+  }
+
+  for (int i = 0; i < markerCount; i++) {
+    pthread_mutex_destroy(&markers[i].lock);
+    free(markers[i].stack);
+    free(markers[i].shared);
+  }
+  free(markers);
+  markers = NULL;
+  idleMarkers = 0;
+}
+
+// the marker thread of clox --gc-concurrent. it blackens the gray
+// objects the script's thread hands over through "inbox" and parks
+// when it runs out of them or finishCycle() wants them back.
+static Marker background;
+static bool backgroundStarted;
+static pthread_mutex_t gcLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wakeMarker = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t markerParked = PTHREAD_COND_INITIALIZER;
+// guarded by gcLock. the marker also checks "pausing"
+// without it, between two objects.
+static Obj** inbox;
+static int inboxCount;
+static int inboxCapacity;
+static bool parked;
+static bool pausing;
+static bool quitting;
+
+static void* markInBackground(void* arg) {
+  marker = (Marker*)arg;
+  pthread_mutex_lock(&gcLock);
+  for (;;) {
+    while (inboxCount > 0) {
+      markerPush(marker, inbox[--inboxCount]);
+    }
+    if (__atomic_load_n(&pausing, __ATOMIC_RELAXED) && marker->count > 0) {
+      growStack(&inbox, &inboxCapacity, marker->count);
+      memcpy(inbox, marker->stack, sizeof(Obj*) * marker->count);
+      inboxCount = marker->count;
+      marker->count = 0;
+    }
+    if (marker->count == 0) {
+      parked = true;
+      pthread_cond_broadcast(&markerParked);
+      if (quitting)
+        break;
+      pthread_cond_wait(&wakeMarker, &gcLock);
+      continue;
+    }
+
+    parked = false;
+    pthread_mutex_unlock(&gcLock);
+    Obj* object;
+    while (!__atomic_load_n(&pausing, __ATOMIC_RELAXED) &&
+           (object = markerPop(marker)) != NULL) {
+      blackenObject(object);
+    }
+    pthread_mutex_lock(&gcLock);
+  }
+  pthread_mutex_unlock(&gcLock);
+  return NULL;
+}
+
+// gives the gray stack to the marker thread. returns
+// true when there is nothing left to mark.
+static bool handOver() {
+  if (!backgroundStarted) {
+    pthread_mutex_init(&background.lock, NULL);
+    if (pthread_create(&background.thread, NULL, markInBackground,
+                       &background) != 0)
+      exit(1);
+    backgroundStarted = true;
+  }
+
+  pthread_mutex_lock(&gcLock);
+  bool done = parked && inboxCount == 0 && vm.grayCount == 0;
+  if (vm.grayCount > 0) {
+    growStack(&inbox, &inboxCapacity, inboxCount + vm.grayCount);
+    memcpy(&inbox[inboxCount], vm.grayStack, sizeof(Obj*) * vm.grayCount);
+    inboxCount += vm.grayCount;
+    vm.grayCount = 0;
+    pthread_cond_signal(&wakeMarker);
+  }
+  pthread_mutex_unlock(&gcLock);
+  return done;
+}
+
+// parks the marker thread and puts the objects
+// it didn't get to back on the gray stack.
+static void pauseMarker() {
+  pthread_mutex_lock(&gcLock);
+  __atomic_store_n(&pausing, true, __ATOMIC_RELAXED);
+  while (!parked) {
+    pthread_cond_wait(&markerParked, &gcLock);
+  }
+  for (int i = 0; i < inboxCount; i++) {
+    pushGray(inbox[i]);
+  }
+  inboxCount = 0;
+  __atomic_store_n(&pausing, false, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&gcLock);
+}
+
+#endif
+
+// ends the marker thread of clox --gc-concurrent, if there is one.
+void stopMarking() {
+#ifdef PARALLEL_GC
+  if (!backgroundStarted)
+    return;
+  pthread_mutex_lock(&gcLock);
+  quitting = true;
+  __atomic_store_n(&pausing, true, __ATOMIC_RELAXED);
+  pthread_cond_signal(&wakeMarker);
+  pthread_mutex_unlock(&gcLock);
+  pthread_join(background.thread, NULL);
+
+  pthread_mutex_destroy(&background.lock);
+  free(background.stack);
+  free(inbox);
+  background = (Marker){0};
+  inbox = NULL;
+  inboxCount = inboxCapacity = 0;
+  backgroundStarted = parked = pausing = quitting = false;
+  concurrentCycle = false;
 #endif
 }
 
@@ -152,23 +666,622 @@ void markValue(Value val) {
   markObject(AS_OBJ(val));
 }
 
+// marks an object, returns whether it was marked already. "shared"
+// when other threads may be setting marks: a bitmap word holds the
+// bits of many objects.
+static bool setMarked(Obj* object, bool shared) {
+  bool* header = &object->isMarked;
+  if (isYoung(object) || object->isLarge) {
+    if (shared)
+      return __atomic_exchange_n(header, true, __ATOMIC_RELAXED);
+    bool marked = *header;
+    *header = true;
+    return marked;
+  }
+
+  uintptr_t bit = BIT_OF(object);
+  uint64_t* word = &PAGE_OF(object)->marks[bit / 64];
+  uint64_t mask = (uint64_t)1 << (bit % 64);
+  if (shared)
+    return __atomic_fetch_or(word, mask, __ATOMIC_RELAXED) & mask;
+  bool marked = *word & mask;
+  *word |= mask;
+  return marked;
+}
+
 void markObject(Obj* object) {
   if (object == NULL)
     return;
-  if (object->isMarked)
+#ifdef PARALLEL_GC
+  if (marker != NULL) {
+    // the marker thread leaves the young objects to finishCycle().
+    if (marker == &background && isYoung(object))
+      return;
+    if (!setMarked(object, true))
+      markerPush(marker, object);
+    return;
+  }
+  // the marker thread sets marks as well.
+  if (concurrentCycle) {
+    if (!isYoung(object) && !setMarked(object, true))
+      pushGray(object);
+    return;
+  }
+#endif
+  // minor collections move young objects, the gray stack can't
+  // hold them between steps. finishCycle() gets to them.
+  if (vm.gcPhase == GC_MARKING && isYoung(object))
+    return;
+  if (setMarked(object, false))
     return;
 #ifdef DEBUG_LOG_GC
   printf("%p mark ", (void*)object);
   printValue(OBJ_VAL(object));
   printf("\n");
 #endif
-  object->isMarked = true;
+  pushGray(object);
+}
 
-  if (vm.grayCapacity < vm.grayCount + 1) {
-    vm.grayCapacity = GROW_CAPACITY(vm.grayCapacity);
-    vm.grayStack = realloc(vm.grayStack, sizeof(Obj*) * vm.grayCapacity);
-    if (vm.grayStack == NULL)
+// the slabs.
+
+#define SLOTS_OFFSET ((sizeof(Page) + 15) & ~(size_t)15)
+
+static Obj* slot(Page* page, int index) {
+  return (Obj*)((uint8_t*)page + SLOTS_OFFSET + index * page->slotSize);
+}
+
+static void freePage(Page* page) {
+  free(page->marks);
+  free(page);
+}
+
+static Page* newPage(int sizeClass) {
+  Page* page = vm.sparePages;
+  if (page != NULL) {
+    vm.sparePages = page->next;
+    vm.spareCount--;
+  } else {
+    page = aligned_alloc(SLAB_PAGE_SIZE, SLAB_PAGE_SIZE);
+    if (page == NULL)
+      exit(1);
+    // the sweep leaves them cleared.
+    page->marks = calloc(SLAB_SLOTS / 64, sizeof(uint64_t));
+    if (page->marks == NULL)
       exit(1);
   }
-  vm.grayStack[vm.grayCount++] = object;
-}
\ No newline at end of file
+  page->slotSize = (sizeClass + 1) * 16;
+  page->slotCount = (SLAB_PAGE_SIZE - SLOTS_OFFSET) / page->slotSize;
+  page->freeCount = page->slotCount;
+  page->fresh = 0;
+  page->free = NULL;
+  memset(page->used, 0, sizeof(page->used));
+
+  page->next = vm.pages[sizeClass];
+  vm.pages[sizeClass] = page;
+  page->nextAvailable = vm.available[sizeClass];
+  vm.available[sizeClass] = page;
+  return page;
+}
+
+// memory for an old object, not counted in vm.bytesAllocated. a
+// slot's mark bit is clear: the sweep clears them all, and only
+// frees unmarked objects.
+static Obj* allocateBlock(size_t size) {
+  if (size > SLAB_MAX) {
+    Obj* block = malloc(size);
+    if (block == NULL)
+      exit(1);
+    return block;
+  }
+
+  int sizeClass = (size - 1) / 16;
+  Page* page = vm.available[sizeClass];
+  if (page == NULL)
+    page = newPage(sizeClass);
+  Obj* block = page->free;
+  if (block != NULL) {
+    page->free = *(void**)block;
+  } else {
+    block = slot(page, page->fresh++);
+  }
+  if (--page->freeCount == 0)
+    vm.available[sizeClass] = page->nextAvailable;
+  return block;
+}
+
+// a page that was full only gets available
+// again with the next sweep.
+static void freeBlock(Obj* block, size_t size) {
+  if (size > SLAB_MAX) {
+    free(block);
+    return;
+  }
+
+  Page* page = PAGE_OF(block);
+  uintptr_t bit = BIT_OF(block);
+  page->used[bit / 64] &= ~((uint64_t)1 << (bit % 64));
+  *(void**)block = page->free;
+  page->free = block;
+  page->freeCount++;
+}
+
+// allocates an old object. the GC only sees
+// it once linkObject() was called on it.
+Obj* allocateOld(size_t size) {
+  vm.bytesAllocated += size;
+  collectIfNeeded(size);
+  return allocateBlock(size);
+}
+
+void linkObject(Obj* object, size_t size) {
+  if (size > SLAB_MAX) {
+    if (vm.objectCapacity < vm.objectCount + 1) {
+      vm.objectCapacity = GROW_CAPACITY(vm.objectCapacity);
+      vm.objects = realloc(vm.objects, sizeof(Obj*) * vm.objectCapacity);
+      if (vm.objects == NULL)
+        exit(1);
+    }
+    vm.objects[vm.objectCount++] = object;
+    return;
+  }
+  uintptr_t bit = BIT_OF(object);
+  PAGE_OF(object)->used[bit / 64] |= (uint64_t)1 << (bit % 64);
+}
+
+// frees an old object, linked or not.
+void freeOld(Obj* object, size_t size) {
+  vm.bytesAllocated -= size;
+  freeBlock(object, size);
+}
+
+// an empty page is kept for any size class,
+// up to SLAB_SPARE of them.
+static void releasePage(Page* page) {
+  if (vm.spareCount < SLAB_SPARE) {
+    page->next = vm.sparePages;
+    vm.sparePages = page;
+    vm.spareCount++;
+  } else {
+    freePage(page);
+  }
+}
+
+// frees the dead objects in the slabs, the linked ones that aren't
+// marked, and clears the marks. the pages left empty are released,
+// the others with free slots are available again. asks for a
+// compaction when the live objects would fit in few enough pages.
+static void sweepSlabs() {
+  int pages = 0;
+  int needed = 0;
+  for (int i = 0; i < SLAB_CLASSES; i++) {
+    int live = 0;
+    int slotCount = 0;
+    Page** available = &vm.available[i];
+    Page** link = &vm.pages[i];
+    while (*link != NULL) {
+      Page* page = *link;
+      for (int word = 0; word < SLAB_SLOTS / 64; word++) {
+        uint64_t dead = page->used[word] & ~page->marks[word];
+        for (; dead != 0; dead &= dead - 1) {
+          int bit = word * 64 + __builtin_ctzll(dead);
+          freeObject((Obj*)((uint8_t*)page + bit * 16));
+        }
+        page->marks[word] = 0;
+      }
+
+      if (page->freeCount == page->slotCount) {
+        *link = page->next;
+        releasePage(page);
+        continue;
+      }
+      if (page->freeCount > 0) {
+        *available = page;
+        available = &page->nextAvailable;
+      }
+      pages++;
+      live += page->slotCount - page->freeCount;
+      slotCount = page->slotCount;
+      link = &page->next;
+    }
+    *available = NULL;
+    if (live > 0)
+      needed += (live + slotCount - 1) / slotCount;
+  }
+
+  if (vm.compactThreshold > 0 &&
+      pages - needed > vm.compactThreshold * pages)
+    vm.compactPending = true;
+}
+
+// the nursery.
+
+#define ALIGN(size) (((size) + 7) & ~(size_t)7)
+
+static size_t objectSize(Obj* object) {
+  switch (object->type) {
+  case OBJ_STRING:
+    return STRING_SIZE(((ObjString*)object)->length);
+  case OBJ_FUNCTION:
+    return sizeof(ObjFunction);
+  case OBJ_NATIVE:
+    return sizeof(ObjNative);
+  case OBJ_CLOSURE:
+    return CLOSURE_SIZE(((ObjClosure*)object)->upvalueCount);
+  case OBJ_UPVALUE:
+    return sizeof(ObjUpvalue);
+  }
+  return 0;
+}
+
+// calls "visit" on every object in the nursery, dead ones included.
+static void walkNursery(void (*visit)(Obj* object)) {
+  uint8_t* position = vm.nursery;
+  while (position < vm.nurseryTop) {
+    Obj* object = (Obj*)position;
+    position += ALIGN(objectSize(object));
+    visit(object);
+  }
+}
+
+void initNursery() {
+  vm.nursery = malloc(NURSERY_SIZE);
+  if (vm.nursery == NULL)
+    exit(1);
+  vm.nurseryTop = vm.nursery;
+  vm.nurseryEnd = vm.nursery + NURSERY_SIZE;
+  vm.remembered = NULL;
+  vm.rememberedCount = 0;
+  vm.rememberedCapacity = 0;
+}
+
+void freeNursery() {
+  free(vm.nursery);
+  free(vm.remembered);
+}
+
+// returns NULL if "size" bytes don't fit, the object goes old then.
+Obj* allocateYoung(size_t size) {
+  size = ALIGN(size);
+  collectIfNeeded(size);
+  if (size > NURSERY_LARGE || size > (size_t)(vm.nurseryEnd - vm.nurseryTop))
+    return NULL;
+  Obj* object = (Obj*)vm.nurseryTop;
+  vm.nurseryTop += size;
+  return object;
+}
+
+// gives back the memory of the young object allocated last.
+void releaseYoung(Obj* object, size_t size) {
+  if ((uint8_t*)object + ALIGN(size) == vm.nurseryTop)
+    vm.nurseryTop = (uint8_t*)object;
+}
+
+void rememberObject(Obj* object) {
+  if (vm.rememberedCapacity < vm.rememberedCount + 1) {
+    vm.rememberedCapacity = GROW_CAPACITY(vm.rememberedCapacity);
+    vm.remembered =
+        realloc(vm.remembered, sizeof(Obj*) * vm.rememberedCapacity);
+    if (vm.remembered == NULL)
+      exit(1);
+  }
+  object->isRemembered = true;
+  vm.remembered[vm.rememberedCount++] = object;
+}
+
+// returns where a young object lives after the minor collection,
+// copying it to the old heap the first time it is reached.
+static Obj* promote(Obj* object) {
+  if (object == NULL || !isYoung(object))
+    return object;
+  if (object->isMarked)
+    return FORWARDED(object);
+
+  // no allocateOld(): a full collection can't run in the middle.
+  size_t size = objectSize(object);
+  Obj* copy = allocateBlock(size);
+  vm.bytesAllocated += size;
+  memcpy(copy, object, size);
+  copy->isMarked = false;
+  copy->isLarge = size > SLAB_MAX;
+  // while marking, a promoted object is gray: it stays on the gray
+  // stack after the minor collection and gets blackened in a step.
+  if (vm.gcPhase == GC_MARKING)
+    setMarked(copy, true);
+  copy->isRemembered = false;
+  linkObject(copy, size);
+  if (object->type == OBJ_UPVALUE) {
+    ObjUpvalue* upvalue = (ObjUpvalue*)object;
+    if (upvalue->slot == &upvalue->closed)
+      ((ObjUpvalue*)copy)->slot = &((ObjUpvalue*)copy)->closed;
+  }
+
+  object->isMarked = true;
+  FORWARDED(object) = copy;
+  pushGray(copy);
+  return copy;
+}
+
+typedef Obj* (*MoveFn)(Obj* object);
+
+static void moveValue(Value* value, MoveFn moved) {
+  if (IS_OBJ(*value))
+    *value = OBJ_VAL(moved(AS_OBJ(*value)));
+}
+
+static void moveArray(ValueArray* array, MoveFn moved) {
+  for (int i = 0; i < array->count; i++) {
+    moveValue(&array->values[i], moved);
+  }
+}
+
+// points the fields of an object at where "moved" says
+// the objects in them are now.
+static void moveFields(Obj* object, MoveFn moved) {
+  switch (object->type) {
+  case OBJ_NATIVE:
+  case OBJ_STRING:
+    break;
+  case OBJ_UPVALUE:
+    moveValue(&((ObjUpvalue*)object)->closed, moved);
+    break;
+  case OBJ_FUNCTION: {
+    ObjFunction* func = (ObjFunction*)object;
+    func->name = (ObjString*)moved((Obj*)func->name);
+    moveArray(&func->chunk.constants, moved);
+    break;
+  }
+  case OBJ_CLOSURE: {
+    ObjClosure* closure = (ObjClosure*)object;
+    closure->function = (ObjFunction*)moved((Obj*)closure->function);
+    for (int i = 0; i < closure->upvalueCount; i++) {
+      moveValue(&closure->upvalues[i], moved);
+    }
+    break;
+  }
+  }
+}
+
+static void promoteValue(Value* value) { moveValue(value, promote); }
+
+static void promoteArray(ValueArray* array) { moveArray(array, promote); }
+
+// points the fields of an old object at the promoted copies.
+static void promoteFields(Obj* object) { moveFields(object, promote); }
+
+// a minor collection. only call it where no C local holds a young
+// object: the survivors move.
+void collectNursery() {
+  if (vm.nurseryTop == vm.nursery)
+    return;
+#ifdef DEBUG_LOG_GC
+  printf("-- minor gc begin\n");
+  size_t before = vm.bytesAllocated;
+#endif
+  int gray = vm.grayCount;
+
+  for (Value* slot = vm.stack.values; slot < vm.stack.top; slot++) {
+    promoteValue(slot);
+  }
+  for (int i = 0; i < vm.frameCount; i++) {
+    vm.frames[i].closure = (ObjClosure*)promote((Obj*)vm.frames[i].closure);
+  }
+  for (int i = 0; i < vm.openTop; i++) {
+    vm.openUpvalues[i] = (ObjUpvalue*)promote((Obj*)vm.openUpvalues[i]);
+  }
+  promoteArray(&vm.globalValues);
+  promoteArray(&vm.globalNames);
+  for (int i = 0; i < vm.globalSlots.cap; i++) {
+    Entry* entry = &vm.globalSlots.entries[i];
+    entry->key = (ObjString*)promote((Obj*)entry->key);
+  }
+
+  for (int i = 0; i < vm.rememberedCount; i++) {
+    vm.remembered[i]->isRemembered = false;
+    promoteFields(vm.remembered[i]);
+  }
+  vm.rememberedCount = 0;
+
+  // the promoted objects may point into the nursery too. the ones
+  // below "gray" are waiting to be marked, they are all old.
+  for (int i = gray; i < vm.grayCount; i++) {
+    promoteFields(vm.grayStack[i]);
+  }
+  if (vm.gcPhase != GC_MARKING)
+    vm.grayCount = gray;
+
+  tableRemoveYoung(&vm.strings);
+  vm.nurseryTop = vm.nursery;
+
+#ifdef DEBUG_LOG_GC
+  printf("-- minor gc end\n");
+  printf("   promoted %zu bytes\n", vm.bytesAllocated - before);
+#endif
+
+  collectIfNeeded(0);
+}
+
+// compaction.
+
+// calls "visit" on every linked slab object of a size
+// class, in the order of its pages and their slots.
+static void walkSlabs(int sizeClass, void (*visit)(Obj* object)) {
+  for (Page* page = vm.pages[sizeClass]; page != NULL; page = page->next) {
+    for (int word = 0; word < SLAB_SLOTS / 64; word++) {
+      for (uint64_t used = page->used[word]; used != 0; used &= used - 1) {
+        int bit = word * 64 + __builtin_ctzll(used);
+        visit((Obj*)((uint8_t*)page + bit * 16));
+      }
+    }
+  }
+}
+
+// the objects of a size class keep their order, so the n-th one
+// goes to the n-th slot of its pages. while compacting, the mark
+// bitmap of a page (clear between collections) holds the rank of
+// the first object of each word, and classPages the pages in order.
+static Page** classPages[SLAB_CLASSES];
+
+// returns how many objects the size class has.
+static uint64_t rankObjects(int sizeClass) {
+  int count = 0;
+  for (Page* page = vm.pages[sizeClass]; page != NULL; page = page->next) {
+    count++;
+  }
+  classPages[sizeClass] = malloc(sizeof(Page*) * (count + 1));
+  if (classPages[sizeClass] == NULL)
+    exit(1);
+
+  uint64_t rank = 0;
+  int index = 0;
+  for (Page* page = vm.pages[sizeClass]; page != NULL; page = page->next) {
+    classPages[sizeClass][index++] = page;
+    for (int word = 0; word < SLAB_SLOTS / 64; word++) {
+      page->marks[word] = rank;
+      rank += __builtin_popcountll(page->used[word]);
+    }
+  }
+  return rank;
+}
+
+static Obj* destinationOf(Obj* object) {
+  Page* page = PAGE_OF(object);
+  uintptr_t bit = BIT_OF(object);
+  uint64_t before = page->used[bit / 64] & (((uint64_t)1 << (bit % 64)) - 1);
+  uint64_t rank = page->marks[bit / 64] + __builtin_popcountll(before);
+  Page** pages = classPages[page->slotSize / 16 - 1];
+  return slot(pages[rank / page->slotCount], rank % page->slotCount);
+}
+
+// where an object is once the heap is compacted.
+static Obj* forward(Obj* object) {
+  if (object == NULL || object->isLarge)
+    return object;
+  return destinationOf(object);
+}
+
+static void forwardFields(Obj* object) {
+  moveFields(object, forward);
+  if (object->type == OBJ_UPVALUE) {
+    ObjUpvalue* upvalue = (ObjUpvalue*)object;
+    if (upvalue->slot == &upvalue->closed)
+      upvalue->slot = &((ObjUpvalue*)forward(object))->closed;
+  }
+}
+
+static void forwardTable(Table* table) {
+  for (int i = 0; i < table->cap; i++) {
+    Entry* entry = &table->entries[i];
+    entry->key = (ObjString*)forward((Obj*)entry->key);
+    moveValue(&entry->value, forward);
+  }
+}
+
+static void forwardRoots() {
+  for (Value* slot = vm.stack.values; slot < vm.stack.top; slot++) {
+    moveValue(slot, forward);
+  }
+  for (int i = 0; i < vm.frameCount; i++) {
+    vm.frames[i].closure = (ObjClosure*)forward((Obj*)vm.frames[i].closure);
+  }
+  for (int i = 0; i < vm.openTop; i++) {
+    vm.openUpvalues[i] = (ObjUpvalue*)forward((Obj*)vm.openUpvalues[i]);
+  }
+  moveArray(&vm.globalValues, forward);
+  moveArray(&vm.globalNames, forward);
+  forwardTable(&vm.globalSlots);
+  forwardTable(&vm.strings);
+}
+
+// the objects move in the order of their ranks, so a slot is free
+// or already moved out of by the time it is written to.
+static void moveObject(Obj* object) {
+  Obj* destination = destinationOf(object);
+  if (destination != object)
+    memmove(destination, object, PAGE_OF(object)->slotSize);
+}
+
+// marks the first "count" slots of a page used, the others free.
+static void fillPage(Page* page, int count) {
+  memset(page->used, 0, sizeof(page->used));
+  memset(page->marks, 0, sizeof(uint64_t) * (SLAB_SLOTS / 64));
+  for (int i = 0; i < count; i++) {
+    uintptr_t bit = BIT_OF(slot(page, i));
+    page->used[bit / 64] |= (uint64_t)1 << (bit % 64);
+  }
+  page->free = NULL;
+  page->fresh = count;
+  page->freeCount = page->slotCount - count;
+}
+
+// the first pages of a size class hold its "count" objects
+// now, the others are released.
+static void fillPages(int sizeClass, uint64_t count) {
+  vm.available[sizeClass] = NULL;
+  Page** link = &vm.pages[sizeClass];
+  while (count > 0) {
+    Page* page = *link;
+    int filled = page->slotCount;
+    if (count < (uint64_t)filled)
+      filled = (int)count;
+    fillPage(page, filled);
+    if (page->freeCount > 0) {
+      page->nextAvailable = NULL;
+      vm.available[sizeClass] = page;
+    }
+    count -= filled;
+    link = &page->next;
+  }
+
+  Page* rest = *link;
+  *link = NULL;
+  while (rest != NULL) {
+    Page* next = rest->next;
+    fillPage(rest, 0);
+    releasePage(rest);
+    rest = next;
+  }
+}
+
+// the linked objects of each size class slide to the front of its
+// pages: every reference is pointed to where its object goes, then
+// they move. the large objects stay where they are. the dead ones
+// (allocated since the last sweep) move along, they only point at
+// objects that weren't freed.
+static void compactHeap() {
+#ifdef DEBUG_LOG_GC
+  printf("-- compact begin\n");
+#endif
+  // the marking can't follow objects around.
+  if (vm.gcPhase != GC_IDLE)
+    finishCycle();
+
+  uint64_t counts[SLAB_CLASSES];
+  for (int i = 0; i < SLAB_CLASSES; i++) {
+    counts[i] = rankObjects(i);
+  }
+
+  forwardRoots();
+  for (int i = 0; i < SLAB_CLASSES; i++) {
+    walkSlabs(i, forwardFields);
+  }
+  for (int i = 0; i < vm.objectCount; i++) {
+    forwardFields(vm.objects[i]);
+  }
+
+  for (int i = 0; i < SLAB_CLASSES; i++) {
+    walkSlabs(i, moveObject);
+    fillPages(i, counts[i]);
+    free(classPages[i]);
+  }
+  vm.compactPending = false;
+
+#ifdef DEBUG_LOG_GC
+  printf("-- compact end\n");
+#endif
+}
+
+void gcSafepoint() {
+  collectNursery();
+  if (vm.compactPending)
+    compactHeap();
+}
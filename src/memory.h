@@ -8,6 +8,136 @@
 #define ALLOCATE_OBJ(type, objectType)                                         \
   (type*)allocateObject(sizeof(type), objectType)
 
+// the heap may grow to GC_HEAP_MIN bytes before the first
+// collection. after a collection, the next one runs once the heap
+// has grown by vm.heapGrowFactor (clox --gc-growth <factor>).
+#define GC_HEAP_MIN (1024 * 1024)
+#define GC_HEAP_GROW_FACTOR 2.0
+
+/*
+    GENERATIONAL GC:
+    new objects are bump-allocated in the nursery, a fixed block
+    of NURSERY_SIZE bytes. once NURSERY_MINOR bytes of it are used,
+    the next safepoint (an instruction boundary right after an
+    allocation, a loop back-edge or a call, where every live object
+    is in a root) runs a minor collection: the young objects the
+    roots or the remembered set reach are copied out to the old
+    heap (promoted), the rest die with the nursery in one go.
+
+    the old heap is the one that collectGarbage() marks and
+    sweeps, it never moves objects so it can run at any allocation
+    (only a compaction does, at a safepoint). an old object that
+    gets a pointer to a young one is put in the remembered set by
+    writeBarrier().
+
+    objects the nursery can't take (it's full before a safepoint
+    came by, or they are larger than NURSERY_LARGE) are allocated
+    old. functions are always old, they own code and are long-lived.
+*/
+// during a minor collection, a young object that was promoted is
+// marked and its second word (every object has one) holds the
+// address of its copy.
+#define FORWARDED(object) (((Obj**)(object))[1])
+/*
+    INCREMENTAL MARKING (clox --gc-incremental):
+    a collection of the old heap is spread over many small steps.
+    once the heap passes nextGC, the roots are marked gray, then
+    every GC_STEP_BYTES allocated a step blackens up to
+    vm.gcStepObjects gray objects (clox --gc-step <n>). when the
+    gray stack runs dry, finishCycle() marks the roots again, traces
+    the young objects, and sweeps, like a full collection would.
+
+    objects allocated during the marking start white. an old object
+    stored into another one is marked by writeBarrier(), the one it
+    replaces by preWriteBarrier(). anything only held by roots is
+    found when they are marked again.
+*/
+/*
+    CONCURRENT MARKING (clox --gc-concurrent):
+    the same cycle, but the gray objects are blackened by a marker
+    thread while the script keeps running. the script's thread
+    marks the roots, and whatever the write barriers and the minor
+    collections turn gray, and hands them to the marker every
+    GC_STEP_BYTES. once the marker runs dry, or the heap has grown
+    by another nextGC bytes, finishCycle() stops it and remarks.
+
+    the marker never touches a young object and never frees
+    anything, so the script only waits for it in finishCycle().
+    it does read fields while the script stores into them, a word
+    at a time: it sees either value, the barriers mark both.
+    a cycle only starts while a script runs (not while compiling,
+    the compiler grows the constant arrays in place).
+*/
+typedef enum { GC_IDLE, GC_MARKING, GC_FINISHING } GCPhase;
+
+/*
+    SLABS:
+    old objects of up to SLAB_MAX bytes live in pages of
+    SLAB_PAGE_SIZE bytes, each one cut into slots of a single size
+    class (a multiple of 16 bytes). a page keeps a free list of its
+    slots and a bitmap of the ones whose object is linked (handed
+    to the GC). the larger objects are malloc()ed and kept in the
+    vm.objects array.
+
+    the mark bits of the slab objects are in a bitmap per page too,
+    allocated apart from the page: marking writes to the bitmaps
+    only, not to the objects (or the pages they share with a forked
+    process). both bitmaps have a bit per 16 bytes of the page, so
+    the sweep finds the dead objects a word at a time, the linked
+    and unmarked ones. young and large objects are marked in their
+    header.
+*/
+/*
+    COMPACTION (clox --gc-compact <fraction>, or compactHeap()):
+    once a sweep finds that more than that fraction of the slab
+    pages would be left empty if the live objects were packed
+    together, or the script calls compactHeap() (which collects
+    first), the next safepoint slides the slab objects of each
+    size class to the front of its pages, keeping their order.
+    the emptied pages are released. every reference
+    to a moved object is updated: the stack, the frames, the open
+    upvalues, the globals, the tables and the fields of the other
+    objects (constants, upvalues). the large objects don't move.
+*/
+#define SLAB_PAGE_SIZE (64 * 1024)
+#define SLAB_MAX 256
+#define SLAB_CLASSES (SLAB_MAX / 16)
+#define SLAB_SLOTS (SLAB_PAGE_SIZE / 16)
+// how many empty pages the sweep keeps around.
+#define SLAB_SPARE 64
+
+typedef struct sPage {
+  // the other pages of the size class.
+  struct sPage* next;
+  // the next one with free slots, as of the last sweep.
+  struct sPage* nextAvailable;
+  // the slots freed since, linked through their first word,
+  // and the first of the ones never used.
+  void* free;
+  int fresh;
+  int slotSize;
+  int slotCount;
+  int freeCount;
+  uint64_t used[SLAB_SLOTS / 64];
+  uint64_t* marks;
+} Page;
+
+#define PAGE_OF(object)                                                        \
+  ((Page*)((uintptr_t)(object) & ~(uintptr_t)(SLAB_PAGE_SIZE - 1)))
+// the bit of an object in its page's bitmaps.
+#define BIT_OF(object) (((uintptr_t)(object) & (SLAB_PAGE_SIZE - 1)) / 16)
+
+// with clox --gc-threads <n>, the marking of a stop-the-world
+// collection is shared by n threads once the heap is this big.
+#define GC_PARALLEL_MIN (1024 * 1024)
+
+#define GC_STEP_BYTES (16 * 1024)
+#define GC_STEP_OBJECTS 200
+
+#define NURSERY_SIZE (256 * 1024)
+#define NURSERY_MINOR (NURSERY_SIZE / 4 * 3)
+#define NURSERY_LARGE (NURSERY_SIZE / 64)
+
 #define GROW_CAPACITY(capacity) (((capacity) < 8) ? 8 : (capacity)*2)
 
 #define FREE(type, ptr) reallocate(ptr, sizeof(type), 0)
@@ -15,8 +145,21 @@
 void* reallocate(void* pointer, size_t oldCapacity, size_t newCapacity);
 void freeObjects();
 void collectGarbage();
+void initNursery();
+void freeNursery();
+Obj* allocateYoung(size_t size);
+void releaseYoung(Obj* object, size_t size);
+void rememberObject(Obj* object);
+Obj* allocateOld(size_t size);
+void linkObject(Obj* object, size_t size);
+void freeOld(Obj* object, size_t size);
+void collectNursery();
+// runs at a safepoint once safepointDue(): the minor
+// collection, and the compaction if one is due.
+void gcSafepoint();
 void markValue(Value value);
 void markObject(Obj* object);
+void stopMarking();
 
 // moves a bunch of bytes from one position in memory to
 // a larger position in memory with more empty space
@@ -9,24 +9,42 @@
 #include "value.h"
 #include "vm.h"
 
-static Obj* allocateObject(size_t size, ObjType type) {
-  Obj* object = (Obj*)reallocate(NULL, 0, size);
+// allocates an object in the old heap without
+// handing it to the GC (see linkObject()).
+static Obj* xallocateOld(size_t size, ObjType type) {
+  Obj* object = allocateOld(size);
   object->type = type;
-  object->next = vm.objects;
   object->isMarked = false;
-  vm.objects = object;
-
-#ifdef DEBUG_LOG_GC
-  printf("%p allocate %ld for %d\n", (void*)object, size, type);
-#endif
-
+  object->isRemembered = false;
+  object->isLarge = size > SLAB_MAX;
+  // it may get pointers to young objects before
+  // anything writes to it through a barrier.
+  if (type != OBJ_STRING && type != OBJ_NATIVE && vm.nurseryTop != vm.nursery)
+    rememberObject(object);
   return object;
 }
 
 // allocate an object without storing it to the VM's object linked list
 static Obj* xallocateObject(size_t size, ObjType type) {
-  Obj* object = (Obj*)reallocate(NULL, 0, size);
+  Obj* object = allocateYoung(size);
+  if (object == NULL)
+    return xallocateOld(size, type);
   object->type = type;
+  object->isMarked = false;
+  object->isRemembered = false;
+  object->isLarge = false;
+  return object;
+}
+
+static Obj* allocateObject(size_t size, ObjType type) {
+  Obj* object = xallocateObject(size, type);
+  if (!isYoung(object))
+    linkObject(object, size);
+
+#ifdef DEBUG_LOG_GC
+  printf("%p allocate %ld for %d\n", (void*)object, size, type);
+#endif
+
   return object;
 }
 
@@ -42,10 +60,8 @@ static uint32_t hashString(const char* key, int length) {
 }
 
 static ObjString* allocateString(char* chars, int length) {
-  // size of an ObjString + number of characters + one extra
-  // for null terminator
-  int size = sizeof(ObjString) + sizeof(char) * (length + 1);
-  ObjString* string = (ObjString*)allocateObject(size, OBJ_STRING);
+  ObjString* string =
+      (ObjString*)allocateObject(STRING_SIZE(length), OBJ_STRING);
 
   for (int i = 0; chars[i]; i++) {
     string->chars[i] = chars[i];
@@ -62,37 +78,43 @@ static void writeToString(ObjString* string, const char* chars) {
     string->chars[i] = chars[i];
   }
   string->chars[string->length] = '\0';
-  string->hash = hashString(string->chars, string->length);
 }
 
 static void storeString(ObjString* string) {
+  // the string isn't in the object list yet, a collection
+  // while the table grows can't free it.
   tableSet(&vm.strings, string, NIL_VAL);
-  ((Obj*)string)->next = vm.objects;
-  vm.objects = (Obj*)string;
+  if (!isYoung((Obj*)string))
+    linkObject((Obj*)string, STRING_SIZE(string->length));
 }
 
 // creates a string object without initializing the character array,
 // doesn't check for interning and
 // doesn't store it in the VM's object linked list
 ObjString* xallocateString(int length) {
-  int size = sizeof(ObjString) + sizeof(char) * (length + 1);
-  ObjString* string = (ObjString*)xallocateObject(size, OBJ_STRING);
+  ObjString* string =
+      (ObjString*)xallocateObject(STRING_SIZE(length), OBJ_STRING);
   string->length = length;
   string->chars[length] = '\0';
   return string;
 }
 
+// hashes the characters the string was filled with. then,
 // if the string is interned, assigns the ObjString pointer
 // to the interned string, freeing it's original contents.
 // Else adds it as a new string to the intern table, and threads
 // it in the VM's object list for GC.
 ObjString* validateString(ObjString* string) {
+  string->hash = hashString(string->chars, string->length);
   // 1. if the string is interned, return
   ObjString* interned =
       tableFindString(&vm.strings, string->chars, string->length, string->hash);
   if (interned != NULL) {
-    // TODO: free the parameter string from memory
-    free(string);
+    if (isYoung((Obj*)string)) {
+      releaseYoung((Obj*)string, STRING_SIZE(string->length));
+    } else {
+      freeOld((Obj*)string, STRING_SIZE(string->length));
+    }
     return interned;
   }
   // if not interned, add it to the head of VM's
@@ -118,11 +140,20 @@ ObjString* copyString(const char* chars, int length) {
 }
 
 ObjFunction* newFunction() {
-  ObjFunction* func = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION);
+  // functions skip the nursery: they own their chunks, which
+  // a young object couldn't free when it dies.
+  ObjFunction* func =
+      (ObjFunction*)xallocateOld(sizeof(ObjFunction), OBJ_FUNCTION);
+  linkObject((Obj*)func, sizeof(ObjFunction));
   func->arity = 0;
+  func->maxStack = 0;
   func->upvalueCount = 0;
   func->name = NULL;
   initChunk(&func->chunk);
+  initRegChunk(&func->registerCode);
+  func->jit = NULL;
+  func->hotness = 0;
+  func->compiled = NULL;
   return func;
 }
 
@@ -133,23 +164,19 @@ ObjNative* newNative(NativeFn function) {
 }
 
 ObjClosure* newClosure(ObjFunction* func) {
-  ObjClosure* closure = ALLOCATE_OBJ(ObjClosure, OBJ_CLOSURE);
+  ObjClosure* closure = (ObjClosure*)allocateObject(
+      CLOSURE_SIZE(func->upvalueCount), OBJ_CLOSURE);
   closure->function = func;
-  ObjUpvalue** upvalues = ALLOCATE(ObjUpvalue*, func->upvalueCount);
-
+  closure->upvalueCount = func->upvalueCount;
   for (int i = 0; i < func->upvalueCount; i++) {
-    upvalues[i] = NULL;
+    closure->upvalues[i] = NIL_VAL;
   }
-
-  closure->upvalues = upvalues;
-  closure->upvalueCount = func->upvalueCount;
   return closure;
 }
 
 ObjUpvalue* newUpvalue(Value* slot) {
   ObjUpvalue* upval = ALLOCATE_OBJ(ObjUpvalue, OBJ_UPVALUE);
   upval->slot = slot;
-  upval->next = NULL;
   upval->closed = NIL_VAL;
   return upval;
 }
@@ -3,6 +3,7 @@
 
 #include "chunk.h"
 #include "common.h"
+#include "regchunk.h"
 #include "value.h"
 
 #define OBJ_TYPE(value) (AS_OBJ(value)->type)
@@ -17,6 +18,7 @@
 #define AS_NATIVE(value) (((ObjNative*)AS_OBJ(value))->function)
 #define AS_CSTRING(value) (((ObjString*)AS_OBJ(value))->chars)
 #define AS_CLOSURE(value) ((ObjClosure*)AS_OBJ(value))
+#define AS_UPVALUE(value) ((ObjUpvalue*)AS_OBJ(value))
 
 typedef enum {
   OBJ_STRING,
@@ -26,16 +28,42 @@ typedef enum {
   OBJ_UPVALUE
 } ObjType;
 
+// the header is a single word, a byte each. the GC keeps no
+// pointers in it: the old heap finds its objects through the slab
+// bitmaps and vm.objects, a promoted young object points to its
+// copy from its payload (see FORWARDED()).
 struct sObj {
-  ObjType type;
-  struct sObj* next;
+  // an ObjType.
+  uint8_t type;
+  // only used by young and large objects, see isMarked().
   bool isMarked;
+  // the object is in vm.remembered.
+  bool isRemembered;
+  // an old object of more than SLAB_MAX bytes.
+  bool isLarge;
 };
 
+typedef struct sJitCode JitCode;
+
+// a function that clox --emit-c translated to C. it runs the frame
+// whose closure is in slots[0], false means a runtime error.
+typedef bool (*CompiledFn)(Value* slots);
+
 typedef struct {
   Obj obj;
   int arity;
+  // the most values a frame of this function holds at
+  // once, the callee and the arguments included.
+  int maxStack;
   Chunk chunk;
+  // the same code for the register VM, only
+  // made when running with --register.
+  RegChunk registerCode;
+  // the machine code, once the function got hot.
+  JitCode* jit;
+  int hotness;
+  // NULL unless the function was loaded from generated C.
+  CompiledFn compiled;
   int upvalueCount;
   ObjString* name;
 } ObjFunction;
@@ -44,14 +72,16 @@ typedef struct ObjUpvalue {
   Obj obj;
   Value* slot;
   Value closed;
-  struct ObjUpvalue* next;
 } ObjUpvalue;
 
 typedef struct {
   Obj obj;
-  ObjFunction* function;
-  ObjUpvalue** upvalues;
   int upvalueCount;
+  ObjFunction* function;
+  // in the closure itself, it takes a single allocation. an
+  // ObjUpvalue, or the value itself for a variable that is never
+  // assigned (CAPTURE_VALUE).
+  Value upvalues[];
 } ObjClosure;
 
 typedef Value (*NativeFn)(int argCount, Value* args);
@@ -69,6 +99,12 @@ struct sObjString {
   char chars[];
 };
 
+// the bytes an ObjString of "length" characters takes.
+#define STRING_SIZE(length) (sizeof(ObjString) + sizeof(char) * ((length) + 1))
+// the bytes an ObjClosure with "count" upvalues takes.
+#define CLOSURE_SIZE(count)                                                    \
+  (sizeof(ObjClosure) + sizeof(Value) * (count))
+
 ObjFunction* newFunction();
 ObjClosure* newClosure(ObjFunction* function);
 ObjUpvalue* newUpvalue(Value* slot);
@@ -0,0 +1,30 @@
+#include "regchunk.h"
+#include "memory.h"
+
+void initRegChunk(RegChunk* chunk) {
+  chunk->count = 0;
+  chunk->capacity = 0;
+  chunk->code = NULL;
+  chunk->lines = NULL;
+  chunk->registerCount = 0;
+}
+
+// returns the index of the instruction.
+int writeRegChunk(RegChunk* chunk, uint32_t instruction, int line) {
+  if (chunk->count + 1 > chunk->capacity) {
+    int oldCapacity = chunk->capacity;
+    chunk->capacity = GROW_CAPACITY(chunk->capacity);
+    chunk->code =
+        GROW_ARRAY(chunk->code, uint32_t, oldCapacity, chunk->capacity);
+    chunk->lines = GROW_ARRAY(chunk->lines, int, oldCapacity, chunk->capacity);
+  }
+  chunk->lines[chunk->count] = line;
+  chunk->code[chunk->count] = instruction;
+  return chunk->count++;
+}
+
+void freeRegChunk(RegChunk* chunk) {
+  FREE_ARRAY(chunk->code, uint32_t, chunk->capacity);
+  FREE_ARRAY(chunk->lines, int, chunk->capacity);
+  initRegChunk(chunk);
+}
@@ -0,0 +1,97 @@
+#ifndef clox_regchunk_h
+#define clox_regchunk_h
+
+#include "common.h"
+
+/*
+    REGISTER CHUNK:
+    the code of the register backend (clox --register). every
+    instruction is one 32 bit word in one of two layouts:
+
+      | C: 9 | B: 9 | A: 8 | op: 6 |
+      |    Bx: 18   | A: 8 | op: 6 |
+
+    the registers of a function are the slots of its call frame,
+    the same ones the stack VM uses: register 0 holds the callee,
+    the parameters follow, then the locals and temporaries.
+
+    A always names a register. B and C are "RK" operands: a value
+    below 256 is a register, REG_K | k is constant k of the
+    function's constant pool. Bx is unsigned, sBx = Bx - REG_MAX_SBX
+    is the signed form used by jumps. jump offsets are relative to
+    the instruction after the jump.
+*/
+
+typedef enum {
+  ROP_MOVE,          // R(A) = R(B)
+  ROP_LOADK,         // R(A) = K(Bx)
+  ROP_LOADNIL,       // R(A) = nil
+  ROP_LOADTRUE,      // R(A) = true
+  ROP_LOADFALSE,     // R(A) = false
+  ROP_GET_GLOBAL,    // R(A) = globals[Bx]
+  ROP_DEFINE_GLOBAL, // globals[Bx] = R(A)
+  ROP_SET_GLOBAL,    // globals[Bx] = R(A), the global must be defined
+  ROP_GET_UPVALUE,   // R(A) = upvalues[B]
+  ROP_SET_UPVALUE,   // upvalues[A] = RK(B)
+  ROP_GET_FLAT,      // R(A) = the value in upvalues[B]
+  ROP_GET_ENCLOSING, // R(A) = register B of the frame below
+  ROP_SET_ENCLOSING, // register A of the frame below = RK(B)
+  ROP_ADD,           // R(A) = RK(B) + RK(C)
+  ROP_SUB,           // R(A) = RK(B) - RK(C)
+  ROP_MULT,          // R(A) = RK(B) * RK(C)
+  ROP_DIV,           // R(A) = RK(B) / RK(C)
+  ROP_EQUAL,         // R(A) = RK(B) == RK(C)
+  ROP_NOT_EQUAL,     // R(A) = RK(B) != RK(C)
+  ROP_LESS,          // R(A) = RK(B) < RK(C)
+  ROP_GREATER,       // R(A) = RK(B) > RK(C)
+  ROP_NOT,           // R(A) = !RK(B)
+  ROP_NEGATE,        // R(A) = -RK(B)
+  ROP_PRINT,         // print RK(B)
+  ROP_JUMP,          // pc += sBx
+  ROP_JUMPZ,         // if R(A) is falsey, pc += sBx
+  // compare and jump, the signed offset is the word after
+  // the instruction: if !(RK(B) op RK(C)), pc += offset
+  ROP_EQUAL_JUMPZ,
+  ROP_NOT_EQUAL_JUMPZ,
+  ROP_LESS_JUMPZ,
+  ROP_GREATER_JUMPZ,
+  ROP_CALL,           // R(A) = R(A)(R(A + 1) .. R(A + B))
+  ROP_TAIL_CALL,      // ROP_CALL reusing the frame, see OP_TAIL_CALL
+  ROP_CLOSURE,        // R(A) = closure of K(Bx), followed by one
+                      // (CaptureKind << 8 | index) word per upvalue
+  ROP_CLOSE_UPVALUES, // close the upvalues of R(A) and above
+  ROP_RETURN          // return RK(B)
+} RegOpCode;
+
+#define REG_K 0x100
+#define REG_IS_K(operand) ((operand)&REG_K)
+#define REG_MAX_SBX 0x1ffff
+
+#define REG_ABC(op, a, b, c)                                                   \
+  ((uint32_t)(op) | (uint32_t)(a) << 6 | (uint32_t)(b) << 14 |                 \
+   (uint32_t)(c) << 23)
+#define REG_ABX(op, a, bx)                                                     \
+  ((uint32_t)(op) | (uint32_t)(a) << 6 | (uint32_t)(bx) << 14)
+
+#define REG_OP(instruction) ((instruction)&0x3f)
+#define REG_A(instruction) (((instruction) >> 6) & 0xff)
+#define REG_B(instruction) (((instruction) >> 14) & 0x1ff)
+#define REG_C(instruction) ((instruction) >> 23)
+#define REG_BX(instruction) ((instruction) >> 14)
+#define REG_SBX(instruction) ((int)REG_BX(instruction) - REG_MAX_SBX)
+
+typedef struct {
+  int count;
+  int capacity;
+  uint32_t* code;
+  int* lines;
+  // how many registers the function uses, the
+  // size of its frame.
+  int registerCount;
+} RegChunk;
+
+void initRegChunk(RegChunk* chunk);
+void freeRegChunk(RegChunk* chunk);
+int writeRegChunk(RegChunk* chunk, uint32_t instruction, int line);
+
+#endif
@@ -0,0 +1,498 @@
+#include "regcompiler.h"
+
+#include "memory.h"
+#include "regchunk.h"
+
+/*
+    the register code of a function is made from its stack
+    bytecode in one pass that keeps a model of the value stack.
+    stack slot i at run time is register i, so locals already live
+    in registers and an operator writes its result to the register
+    of the slot the stack VM would have pushed it to.
+
+    pushing a local or a constant emits nothing, the stack entry
+    only remembers where the value is and the instruction that
+    consumes it reads it from there. an entry is materialized into
+    its own register when the value has to be in place: at jumps,
+    jump targets and calls, when its local is about to be
+    overwritten, or when it becomes a local itself.
+*/
+
+#define MAX_REGISTERS (UINT8_MAX + 1)
+
+typedef enum {
+  ENTRY_REGISTER, // the value is in the entry's own register.
+  ENTRY_LOCAL,    // the value is in register "index".
+  ENTRY_CONSTANT  // the value is constant "index".
+} EntryKind;
+
+typedef struct {
+  EntryKind kind;
+  int index;
+} Entry;
+
+typedef struct {
+  Chunk* chunk;
+  RegChunk* code;
+  Entry stack[MAX_REGISTERS];
+  int depth;
+  // the line of the stack instruction being translated.
+  int line;
+  // the instruction that computed the top entry into its register,
+  // an assignment to a local can make it write the local instead.
+  int lastResult;
+  // per stack instruction: is it a jump target, the register pc it
+  // starts at and the stack depth before it (see stackDepths()).
+  bool* isTarget;
+  int* labels;
+  int* depths;
+  // pairs of (jump instruction, target stack offset) that are
+  // patched once every label is known.
+  int* patches;
+  int patchCount;
+  bool failed;
+} Translator;
+
+static int emit(Translator* t, uint32_t instruction) {
+  return writeRegChunk(t->code, instruction, t->line);
+}
+
+static void push(Translator* t, EntryKind kind, int index) {
+  if (t->depth == MAX_REGISTERS) {
+    t->failed = true;
+    return;
+  }
+  t->stack[t->depth].kind = kind;
+  t->stack[t->depth].index = index;
+  t->depth++;
+  if (t->depth > t->code->registerCount)
+    t->code->registerCount = t->depth;
+}
+
+// emits an instruction that leaves its result in the register of
+// the next free slot and pushes that result. "instruction" must
+// have A set to t->depth.
+static void emitResult(Translator* t, uint32_t instruction) {
+  if (t->depth == MAX_REGISTERS) {
+    t->failed = true;
+    return;
+  }
+  int index = emit(t, instruction);
+  push(t, ENTRY_REGISTER, 0);
+  t->lastResult = index;
+}
+
+static void materialize(Translator* t, int slot) {
+  Entry* entry = &t->stack[slot];
+  if (entry->kind == ENTRY_LOCAL) {
+    emit(t, REG_ABC(ROP_MOVE, slot, entry->index, 0));
+  } else if (entry->kind == ENTRY_CONSTANT) {
+    emit(t, REG_ABX(ROP_LOADK, slot, entry->index));
+  }
+  entry->kind = ENTRY_REGISTER;
+}
+
+// puts every entry in its own register, the state the code
+// on both sides of a jump agrees on.
+static void flush(Translator* t) {
+  for (int slot = 0; slot < t->depth; slot++) {
+    materialize(t, slot);
+  }
+}
+
+// the RK operand that reads the entry in "slot".
+static int operand(Translator* t, int slot) {
+  Entry* entry = &t->stack[slot];
+  switch (entry->kind) {
+  case ENTRY_LOCAL:
+    return entry->index;
+  case ENTRY_CONSTANT:
+    return REG_K | entry->index;
+  default:
+    return slot;
+  }
+}
+
+static int popOperand(Translator* t) {
+  t->depth--;
+  return operand(t, t->depth);
+}
+
+// a register that holds the entry in "slot", for the
+// instructions that can't take a constant.
+static int registerOperand(Translator* t, int slot) {
+  if (t->stack[slot].kind == ENTRY_CONSTANT)
+    materialize(t, slot);
+  return t->stack[slot].kind == ENTRY_LOCAL ? t->stack[slot].index : slot;
+}
+
+static bool aliasesLocal(Translator* t, int slot, int local) {
+  return t->stack[slot].kind == ENTRY_LOCAL && t->stack[slot].index == local;
+}
+
+// an assignment "local = <result>" can have the instruction that made
+// the result write it to the local directly, if nothing was emitted
+// after it and no other entry still needs the local's old value.
+static bool canRetarget(Translator* t, int local) {
+  int top = t->depth - 1;
+  if (t->lastResult < 0 || t->lastResult != t->code->count - 1 ||
+      t->stack[top].kind != ENTRY_REGISTER ||
+      REG_A(t->code->code[t->lastResult]) != (uint32_t)top ||
+      t->stack[local].kind != ENTRY_REGISTER)
+    return false;
+
+  for (int slot = local + 1; slot < top; slot++) {
+    if (aliasesLocal(t, slot, local))
+      return false;
+  }
+  return true;
+}
+
+// stores the top entry into "local", it stays on the stack.
+static void storeLocal(Translator* t, int local) {
+  int top = t->depth - 1;
+  Entry value = t->stack[top];
+  if (value.kind == ENTRY_LOCAL && value.index == local)
+    return;
+
+  if (canRetarget(t, local)) {
+    uint32_t* instruction = &t->code->code[t->lastResult];
+    *instruction = (*instruction & ~(0xffu << 6)) | (uint32_t)local << 6;
+    t->stack[top].kind = ENTRY_LOCAL;
+    t->stack[top].index = local;
+    t->lastResult = -1;
+    return;
+  }
+
+  // the old value of the local must be read by everything
+  // that was pushed before the assignment.
+  materialize(t, local);
+  for (int slot = local + 1; slot < top; slot++) {
+    if (aliasesLocal(t, slot, local))
+      materialize(t, slot);
+  }
+
+  if (value.kind == ENTRY_CONSTANT) {
+    emit(t, REG_ABX(ROP_LOADK, local, value.index));
+  } else {
+    emit(t, REG_ABC(ROP_MOVE, local, operand(t, top), 0));
+  }
+}
+
+static bool isCompareJump(RegOpCode op) {
+  return op >= ROP_EQUAL_JUMPZ && op <= ROP_GREATER_JUMPZ;
+}
+
+// emits a jump to the stack instruction at "target",
+// the code has to be flushed.
+static void emitJump(Translator* t, uint32_t instruction, int target) {
+  int index = emit(t, instruction);
+  if (isCompareJump(REG_OP(instruction)))
+    emit(t, 0);
+
+  t->patches[2 * t->patchCount] = index;
+  t->patches[2 * t->patchCount + 1] = target;
+  t->patchCount++;
+  t->lastResult = -1;
+}
+
+static int readShort(uint8_t* code) { return (code[0] << 8) | code[1]; }
+
+static RegOpCode binaryOp(uint8_t op) {
+  switch (op) {
+  case OP_ADD:
+    return ROP_ADD;
+  case OP_SUB:
+    return ROP_SUB;
+  case OP_MULT:
+    return ROP_MULT;
+  case OP_DIV:
+    return ROP_DIV;
+  case OP_EQUAL:
+    return ROP_EQUAL;
+  case OP_NOT_EQUAL:
+    return ROP_NOT_EQUAL;
+  case OP_LESS:
+    return ROP_LESS;
+  default:
+    return ROP_GREATER;
+  }
+}
+
+// the compare-and-jump form of a comparison, or -1.
+static int compareJumpOp(uint8_t op) {
+  switch (op) {
+  case OP_EQUAL:
+    return ROP_EQUAL_JUMPZ;
+  case OP_NOT_EQUAL:
+    return ROP_NOT_EQUAL_JUMPZ;
+  case OP_LESS:
+    return ROP_LESS_JUMPZ;
+  case OP_GREATER:
+    return ROP_GREATER_JUMPZ;
+  default:
+    return -1;
+  }
+}
+
+static void patchJumps(Translator* t) {
+  for (int i = 0; i < t->patchCount; i++) {
+    int index = t->patches[2 * i];
+    uint32_t* instruction = &t->code->code[index];
+    if (isCompareJump(REG_OP(*instruction))) {
+      int offset = t->labels[t->patches[2 * i + 1]] - (index + 2);
+      instruction[1] = (uint32_t)offset;
+    } else {
+      int offset = t->labels[t->patches[2 * i + 1]] - (index + 1);
+      *instruction = REG_ABX(REG_OP(*instruction), REG_A(*instruction),
+                             offset + REG_MAX_SBX);
+    }
+  }
+}
+
+static void translate(Translator* t, ObjFunction* function) {
+  Chunk* chunk = t->chunk;
+  bool reachable = true;
+  t->depth = 0;
+  for (int i = 0; i <= function->arity; i++) {
+    push(t, ENTRY_REGISTER, 0);
+  }
+
+  for (int offset = 0; offset < chunk->count && !t->failed;) {
+    uint8_t* code = &chunk->code[offset];
+    int next = offset + instructionLength(chunk, offset);
+    t->line = chunk->lines[offset];
+
+    if (t->isTarget[offset] || !reachable) {
+      if (reachable) {
+        flush(t);
+      } else {
+        // code after a jump, only entered through a jump
+        // (or never). everything is in its register.
+        t->depth = t->depths[offset];
+        for (int slot = 0; slot < t->depth; slot++) {
+          t->stack[slot].kind = ENTRY_REGISTER;
+        }
+      }
+      t->labels[offset] = t->code->count;
+      t->lastResult = -1;
+      reachable = true;
+    }
+
+    switch (code[0]) {
+    case OP_RETURN: {
+      int value = popOperand(t);
+      emit(t, REG_ABC(ROP_RETURN, 0, value, 0));
+      reachable = false;
+      break;
+    }
+    case OP_CONSTANT:
+      push(t, ENTRY_CONSTANT, code[1]);
+      break;
+    case OP_NIL:
+      emitResult(t, REG_ABC(ROP_LOADNIL, t->depth, 0, 0));
+      break;
+    case OP_TRUE:
+      emitResult(t, REG_ABC(ROP_LOADTRUE, t->depth, 0, 0));
+      break;
+    case OP_FALSE:
+      emitResult(t, REG_ABC(ROP_LOADFALSE, t->depth, 0, 0));
+      break;
+    case OP_NOT:
+    case OP_NEGATE: {
+      int value = popOperand(t);
+      RegOpCode op = code[0] == OP_NOT ? ROP_NOT : ROP_NEGATE;
+      emitResult(t, REG_ABC(op, t->depth, value, 0));
+      break;
+    }
+    case OP_EQUAL:
+    case OP_NOT_EQUAL:
+    case OP_LESS:
+    case OP_GREATER:
+    case OP_MULT:
+    case OP_DIV:
+    case OP_ADD:
+    case OP_SUB: {
+      int b = popOperand(t);
+      int a = popOperand(t);
+      int jumpOp = compareJumpOp(code[0]);
+      // a comparison that only feeds a condition becomes
+      // a compare-and-jump.
+      if (jumpOp >= 0 && next < chunk->count &&
+          chunk->code[next] == OP_POP_JUMPZ && !t->isTarget[next]) {
+        flush(t);
+        emitJump(t, REG_ABC(jumpOp, 0, a, b), jumpTarget(chunk, next));
+        next += instructionLength(chunk, next);
+      } else {
+        emitResult(t, REG_ABC(binaryOp(code[0]), t->depth, a, b));
+      }
+      break;
+    }
+    case OP_PRINT:
+      emit(t, REG_ABC(ROP_PRINT, 0, popOperand(t), 0));
+      break;
+    case OP_POP:
+      t->depth--;
+      t->lastResult = -1;
+      break;
+    case OP_POPN:
+      t->depth -= code[1];
+      t->lastResult = -1;
+      break;
+    case OP_DEFINE_GLOBAL: {
+      int value = registerOperand(t, t->depth - 1);
+      t->depth--;
+      emit(t, REG_ABX(ROP_DEFINE_GLOBAL, value, readShort(code + 1)));
+      break;
+    }
+    case OP_GET_GLOBAL:
+      emitResult(t, REG_ABX(ROP_GET_GLOBAL, t->depth, readShort(code + 1)));
+      break;
+    case OP_SET_GLOBAL: {
+      int value = registerOperand(t, t->depth - 1);
+      emit(t, REG_ABX(ROP_SET_GLOBAL, value, readShort(code + 1)));
+      break;
+    }
+    case OP_SET_LOCAL:
+      storeLocal(t, code[1]);
+      break;
+    case OP_SET_LOCAL_POP:
+      storeLocal(t, code[1]);
+      t->depth--;
+      t->lastResult = -1;
+      break;
+    case OP_GET_LOCAL:
+      materialize(t, code[1]);
+      push(t, ENTRY_LOCAL, code[1]);
+      break;
+    case OP_GET_UPVALUE:
+      emitResult(t, REG_ABC(ROP_GET_UPVALUE, t->depth, code[1], 0));
+      break;
+    case OP_GET_FLAT_UPVALUE:
+      emitResult(t, REG_ABC(ROP_GET_FLAT, t->depth, code[1], 0));
+      break;
+    case OP_SET_UPVALUE:
+      emit(t, REG_ABC(ROP_SET_UPVALUE, code[1], operand(t, t->depth - 1), 0));
+      break;
+    case OP_GET_ENCLOSING:
+      emitResult(t, REG_ABC(ROP_GET_ENCLOSING, t->depth, code[1], 0));
+      break;
+    case OP_SET_ENCLOSING:
+      emit(t,
+           REG_ABC(ROP_SET_ENCLOSING, code[1], operand(t, t->depth - 1), 0));
+      break;
+    case OP_JUMPZ:
+      flush(t);
+      emitJump(t, REG_ABX(ROP_JUMPZ, t->depth - 1, 0),
+               jumpTarget(chunk, offset));
+      break;
+    case OP_POP_JUMPZ: {
+      int condition = registerOperand(t, t->depth - 1);
+      t->depth--;
+      flush(t);
+      emitJump(t, REG_ABX(ROP_JUMPZ, condition, 0), jumpTarget(chunk, offset));
+      break;
+    }
+    case OP_JUMP:
+    case OP_LOOP:
+      flush(t);
+      emitJump(t, REG_ABX(ROP_JUMP, 0, 0), jumpTarget(chunk, offset));
+      reachable = false;
+      break;
+    case OP_LESS_LOCAL_CONST_JUMPZ:
+      flush(t);
+      emitJump(t, REG_ABC(ROP_LESS_JUMPZ, 0, code[1], REG_K | code[2]),
+               jumpTarget(chunk, offset));
+      break;
+    case OP_CALL:
+    case OP_TAIL_CALL: {
+      int base = t->depth - code[1] - 1;
+      flush(t);
+      emit(t, REG_ABC(code[0] == OP_CALL ? ROP_CALL : ROP_TAIL_CALL, base,
+                      code[1], 0));
+      t->depth = base;
+      push(t, ENTRY_REGISTER, 0);
+      t->lastResult = -1;
+      break;
+    }
+    case OP_CLOSURE: {
+      ObjFunction* inner = AS_FUNCTION(chunk->constants.values[code[1]]);
+      // captured locals are read through their slot
+      // from now on, they have to be in it.
+      for (int i = 0; i < inner->upvalueCount; i++) {
+        if (code[2 + 2 * i] != CAPTURE_UPVALUE)
+          materialize(t, code[3 + 2 * i]);
+      }
+      if (t->depth == MAX_REGISTERS) {
+        t->failed = true;
+        break;
+      }
+      emit(t, REG_ABX(ROP_CLOSURE, t->depth, code[1]));
+      for (int i = 0; i < inner->upvalueCount; i++) {
+        emit(t, (uint32_t)code[2 + 2 * i] << 8 | code[3 + 2 * i]);
+      }
+      push(t, ENTRY_REGISTER, 0);
+      t->lastResult = -1;
+      break;
+    }
+    case OP_STACK_CLOSURE:
+      // the closure only reads the captured locals while it is
+      // called, and a call puts every entry in its register.
+      push(t, ENTRY_CONSTANT, code[1]);
+      break;
+    case OP_CLOSE_UPVALUES:
+      for (int i = t->depth - code[1]; i < t->depth; i++) {
+        materialize(t, i);
+      }
+      t->depth -= code[1];
+      emit(t, REG_ABC(ROP_CLOSE_UPVALUES, t->depth, 0, 0));
+      t->lastResult = -1;
+      break;
+    case OP_ADD_LOCALS:
+      materialize(t, code[1]);
+      materialize(t, code[2]);
+      emitResult(t, REG_ABC(ROP_ADD, t->depth, code[1], code[2]));
+      break;
+    }
+
+    offset = next;
+  }
+}
+
+bool compileRegisters(ObjFunction* function) {
+  Chunk* chunk = &function->chunk;
+  Translator t;
+  t.chunk = chunk;
+  t.code = &function->registerCode;
+  t.lastResult = -1;
+  t.patchCount = 0;
+  t.failed = false;
+
+  freeRegChunk(t.code);
+  t.isTarget = ALLOCATE(bool, chunk->count);
+  t.labels = ALLOCATE(int, chunk->count);
+  t.depths = ALLOCATE(int, chunk->count);
+  t.patches = ALLOCATE(int, 2 * chunk->count);
+  stackDepths(chunk, function->arity, t.depths);
+  for (int offset = 0; offset < chunk->count; offset++) {
+    t.isTarget[offset] = false;
+  }
+  for (int offset = 0; offset < chunk->count;
+       offset += instructionLength(chunk, offset)) {
+    int target = jumpTarget(chunk, offset);
+    if (target >= 0)
+      t.isTarget[target] = true;
+  }
+
+  translate(&t, function);
+  if (!t.failed)
+    patchJumps(&t);
+
+  FREE_ARRAY(t.isTarget, bool, chunk->count);
+  FREE_ARRAY(t.labels, int, chunk->count);
+  FREE_ARRAY(t.depths, int, chunk->count);
+  FREE_ARRAY(t.patches, int, 2 * chunk->count);
+  if (t.failed)
+    freeRegChunk(t.code);
+  return !t.failed;
+}
@@ -0,0 +1,11 @@
+#ifndef clox_regcompiler_h
+#define clox_regcompiler_h
+
+#include "object.h"
+
+// translates the stack bytecode of "function" into register code
+// (function->registerCode). returns false if the function would
+// need more than 256 registers.
+bool compileRegisters(ObjFunction* function);
+
+#endif
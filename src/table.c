@@ -6,6 +6,7 @@
 #include "memory.h"
 #include "object.h"
 #include "value.h"
+#include "vm.h"
 
 #define TABLE_MAX_LOAD 0.75
 
@@ -138,6 +139,31 @@ ObjString* tableFindString(Table* table, const char chars[], int length,
   }
 }
 
+// deletes the entries whose keys the GC didn't mark.
+void tableRemoveWhite(Table* table) {
+  for (int i = 0; i < table->cap; i++) {
+    Entry* entry = &table->entries[i];
+    if (entry->key != NULL && !isMarked((Obj*)entry->key)) {
+      tableDelete(table, entry->key);
+    }
+  }
+}
+
+// after a minor collection: points the keys that were promoted
+// at their copies and deletes the ones that died young.
+void tableRemoveYoung(Table* table) {
+  for (int i = 0; i < table->cap; i++) {
+    Entry* entry = &table->entries[i];
+    if (entry->key == NULL || !isYoung((Obj*)entry->key))
+      continue;
+    if (entry->key->obj.isMarked) {
+      entry->key = (ObjString*)FORWARDED((Obj*)entry->key);
+    } else {
+      tableDelete(table, entry->key);
+    }
+  }
+}
+
 void markTable(Table* table) {
   for (int i = 0; i < table->cap; i++) {
     Entry* entry = &table->entries[i];
@@ -22,6 +22,8 @@ bool tableDelete(Table* table, ObjString* key);
 void tableAddAll(Table* from, Table* to);
 ObjString* tableFindString(Table* table, const char chars[], int length,
                            uint32_t hash);
+void tableRemoveWhite(Table* table);
+void tableRemoveYoung(Table* table);
 void markTable(Table* table);
 
 #endif
\ No newline at end of file
@@ -12,6 +12,13 @@
 // A value is just a typedef for the double data type
 
 bool valuesEqual(Value a, Value b) {
+#ifdef NAN_BOXING
+  // compare numbers as doubles so that NaN != NaN
+  // and 0 == -0, everything else is equal by identity.
+  if (IS_NUMBER(a) && IS_NUMBER(b))
+    return AS_NUMBER(a) == AS_NUMBER(b);
+  return a == b;
+#else
   if (a.type != b.type)
     return false;
 
@@ -19,15 +26,30 @@ bool valuesEqual(Value a, Value b) {
   case VAL_BOOL:
     return AS_BOOL(a) == AS_BOOL(b);
   case VAL_NIL:
+  case VAL_UNDEFINED:
     return true;
   case VAL_NUMBER:
     return AS_NUMBER(a) == AS_NUMBER(b);
   case VAL_OBJ:
     return AS_OBJ(a) == AS_OBJ(b);
   }
+#endif
 }
 
 void printValue(Value value) {
+#ifdef NAN_BOXING
+  if (IS_BOOL(value)) {
+    printf(AS_BOOL(value) ? "true" : "false");
+  } else if (IS_NIL(value)) {
+    printf("nil");
+  } else if (IS_NUMBER(value)) {
+    printf("%g", AS_NUMBER(value));
+  } else if (IS_OBJ(value)) {
+    printObject(value);
+  } else if (IS_UNDEFINED(value)) {
+    printf("<undefined>");
+  }
+#else
   switch (value.type) {
   case VAL_BOOL:
     printf(AS_BOOL(value) ? "true" : "false");
@@ -41,7 +63,11 @@ void printValue(Value value) {
   case VAL_OBJ:
     printObject(value);
     break;
+  case VAL_UNDEFINED:
+    printf("<undefined>");
+    break;
   }
+#endif
 }
 
 // value array functions
@@ -69,19 +95,6 @@ void freeValueArray(ValueArray* array) {
 
 // Value stack functions
 
-void pushValue(ValueStack* stack, Value value) {
-  if ((stack->top - stack->values) > stack->size) {
-    int oldSize = stack->size;
-    stack->size = GROW_CAPACITY(stack->size);
-    stack->values = GROW_ARRAY(stack->values, Value, oldSize, stack->size);
-    stack->top = stack->values + oldSize;
-  }
-  *(stack->top) = value;
-  stack->top++;
-}
-
-Value popValue(ValueStack* stack) { return *(--stack->top); }
-
 void initValueStack(ValueStack* stack, size_t size) {
   stack->values = NULL;
   stack->values = GROW_ARRAY(stack->values, Value, 0, size);
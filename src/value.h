@@ -6,7 +6,73 @@
 typedef struct sObj Obj;
 typedef struct sObjString ObjString;
 
-typedef enum { VAL_BOOL, VAL_NIL, VAL_NUMBER, VAL_OBJ } ValueType;
+#ifdef NAN_BOXING
+
+/*
+    NAN BOXING:
+    A Value is a single 64 bit word. Any bit pattern that isn't a
+    quiet NaN is a double. Quiet NaNs (QNAN set) that aren't real
+    numbers hold everything else: the low bits tag nil, true and
+    false, and with the sign bit set the low 48 bits are an Obj*.
+*/
+
+#include <string.h>
+
+#define SIGN_BIT ((uint64_t)0x8000000000000000)
+#define QNAN ((uint64_t)0x7ffc000000000000)
+
+#define TAG_NIL 1   // 01.
+#define TAG_FALSE 2 // 10.
+#define TAG_TRUE 3  // 11.
+#define TAG_UNDEFINED 4
+
+typedef uint64_t Value;
+
+#define FALSE_VAL ((Value)(uint64_t)(QNAN | TAG_FALSE))
+#define TRUE_VAL ((Value)(uint64_t)(QNAN | TAG_TRUE))
+
+// lifts the value from C's static land to Lox's dynamic land
+#define BOOL_VAL(b) ((b) ? TRUE_VAL : FALSE_VAL)
+#define NIL_VAL ((Value)(uint64_t)(QNAN | TAG_NIL))
+#define NUMBER_VAL(num) numToValue(num)
+#define OBJ_VAL(obj) (Value)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(obj))
+#define UNDEFINED_VAL ((Value)(uint64_t)(QNAN | TAG_UNDEFINED))
+
+#define AS_BOOL(value) ((value) == TRUE_VAL)
+#define AS_NUMBER(value) valueToNum(value)
+#define AS_OBJ(value) ((Obj*)(uintptr_t)((value) & ~(SIGN_BIT | QNAN)))
+
+// true and false only differ in the lowest bit,
+// so or-ing in 1 maps both of them to TRUE_VAL.
+#define IS_BOOL(value) (((value) | 1) == TRUE_VAL)
+#define IS_NIL(value) ((value) == NIL_VAL)
+#define IS_NUMBER(value) (((value)&QNAN) != QNAN)
+#define IS_OBJ(value) (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
+#define IS_UNDEFINED(value) ((value) == UNDEFINED_VAL)
+
+// memcpy is the portable way to reinterpret the bits,
+// compilers turn it into a plain register move.
+static inline double valueToNum(Value value) {
+  double num;
+  memcpy(&num, &value, sizeof(Value));
+  return num;
+}
+
+static inline Value numToValue(double num) {
+  Value value;
+  memcpy(&value, &num, sizeof(double));
+  return value;
+}
+
+#else
+
+typedef enum {
+  VAL_BOOL,
+  VAL_NIL,
+  VAL_NUMBER,
+  VAL_OBJ,
+  VAL_UNDEFINED
+} ValueType;
 
 typedef struct {
   ValueType type;
@@ -22,6 +88,7 @@ typedef struct {
 #define NIL_VAL ((Value){VAL_NIL, {.number = 0}})
 #define NUMBER_VAL(value) ((Value){VAL_NUMBER, {.number = value}})
 #define OBJ_VAL(object) ((Value){VAL_OBJ, {.obj = (Obj*)object}})
+#define UNDEFINED_VAL ((Value){VAL_UNDEFINED, {.number = 0}})
 
 #define AS_BOOL(value) ((value).as.boolean)
 #define AS_NUMBER(value) ((value).as.number)
@@ -31,6 +98,12 @@ typedef struct {
 #define IS_NIL(value) ((value).type == VAL_NIL)
 #define IS_NUMBER(value) ((value).type == VAL_NUMBER)
 #define IS_OBJ(value) ((value).type == VAL_OBJ)
+#define IS_UNDEFINED(value) ((value).type == VAL_UNDEFINED)
+
+#endif
+
+// UNDEFINED_VAL marks a global slot that the compiler handed out
+// but that hasn't been defined yet. it never reaches Lox code.
 
 bool valuesEqual(Value a, Value b);
 
@@ -58,8 +131,6 @@ typedef struct {
 
 void initValueStack(ValueStack* stack, size_t size);
 void freeValueStack(ValueStack* stack);
-Value popValue(ValueStack* stack);
-void pushValue(ValueStack* stack, Value value);
 void printValueStack(ValueStack* stack);
 
 #endif
\ No newline at end of file
@@ -10,14 +10,24 @@
 #include "common.h"
 #include "compiler.h"
 #include "debug.h"
+#include "jit.h"
 #include "memory.h"
 #include "object.h"
 #include "table.h"
 #include "value.h"
 
-static void push(Value val) { pushValue(&vm.stack, val); }
+VM vm;
 
-static Value pop() { return popValue(&vm.stack); }
+static void growStack(size_t needed);
+
+void push(Value val) {
+  if (vm.stack.top == vm.stack.values + vm.stack.size) {
+    growStack(vm.stack.size + 1);
+  }
+  *vm.stack.top++ = val;
+}
+
+Value pop() { return *--vm.stack.top; }
 
 static Value peek(size_t distance) { return vm.stack.top[-1 - distance]; }
 
@@ -26,11 +36,122 @@ void printStack() {
   printf(" (%d)\n\n", (int)(vm.stack.top - vm.stack.values));
 }
 
+#ifdef DEBUG_PROFILE_OPCODES
+// how often each opcode ran right after another one, indexed
+// [previous][next]. the superinstructions in chunk.h were picked
+// from this profile.
+static uint64_t opcodePairs[UINT8_MAX + 1][UINT8_MAX + 1];
+static uint8_t previousOpcode = OP_RETURN;
+// the number of instructions the register VM ran, to
+// compare with the stack VM's count on the same script.
+static uint64_t registerInstructions;
+
+static void profileOpcode(uint8_t opcode) {
+  opcodePairs[previousOpcode][opcode]++;
+  previousOpcode = opcode;
+}
+
+static void printOpcodeProfile() {
+  if (registerInstructions > 0) {
+    printf("== %llu register instructions ==\n",
+           (unsigned long long)registerInstructions);
+  }
+
+  uint64_t total = 0;
+  for (int i = 0; i <= UINT8_MAX; i++) {
+    for (int j = 0; j <= UINT8_MAX; j++) {
+      total += opcodePairs[i][j];
+    }
+  }
+  if (total == 0)
+    return;
+
+  printf("== opcode pairs (%llu instructions) ==\n", (unsigned long long)total);
+  // selection of the 20 most frequent pairs, clearing each one
+  // after printing it.
+  for (int n = 0; n < 20; n++) {
+    int first = 0, second = 0;
+    for (int i = 0; i <= UINT8_MAX; i++) {
+      for (int j = 0; j <= UINT8_MAX; j++) {
+        if (opcodePairs[i][j] > opcodePairs[first][second]) {
+          first = i;
+          second = j;
+        }
+      }
+    }
+    uint64_t count = opcodePairs[first][second];
+    if (count == 0)
+      break;
+    printf("%6.2f%%  %-16s -> %s\n", 100.0 * count / total,
+           opcodeName(first), opcodeName(second));
+    opcodePairs[first][second] = 0;
+  }
+}
+#endif
+
 static Value clockNative(int argCount, Value* args) {
   return NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
 }
 
-static void runtimeError(const char* format, ...) {
+// collects the garbage now and compacts the
+// old heap at the safepoint right after the call.
+static Value compactHeapNative(int argCount, Value* args) {
+  collectGarbage();
+  vm.compactPending = true;
+  return NIL_VAL;
+}
+
+static void resetStack() {
+  vm.stack.top = vm.stack.values;
+  vm.frameCount = 0;
+  for (int i = 0; i < vm.openTop; i++) {
+    vm.openUpvalues[i] = NULL;
+  }
+  vm.openTop = 0;
+}
+
+// moves the stack to a buffer of at least "needed" values, pointing
+// the frames and the open upvalues at the same slots in it.
+static void growStack(size_t needed) {
+  size_t oldSize = vm.stack.size;
+  size_t size = oldSize;
+  while (size < needed) {
+    size = GROW_CAPACITY(size);
+  }
+
+  Value* old = vm.stack.values;
+  Value* values = ALLOCATE(Value, size);
+  memcpy(values, old, sizeof(Value) * (vm.stack.top - old));
+  for (int i = 0; i < vm.frameCount; i++) {
+    CallFrame* frame = &vm.frames[i];
+    frame->slots = values + (frame->slots - old);
+    if (vm.registerMode)
+      frame->top = values + (frame->top - old);
+  }
+  ObjUpvalue** open = ALLOCATE(ObjUpvalue*, size);
+  memcpy(open, vm.openUpvalues, sizeof(ObjUpvalue*) * vm.openTop);
+  memset(open + vm.openTop, 0, sizeof(ObjUpvalue*) * (size - vm.openTop));
+  for (int i = 0; i < vm.openTop; i++) {
+    if (open[i] != NULL) open[i]->slot = values + i;
+  }
+  vm.stack.top = values + (vm.stack.top - old);
+  vm.stack.values = values;
+  vm.stack.size = size;
+  FREE_ARRAY(old, Value, oldSize);
+  FREE_ARRAY(vm.openUpvalues, ObjUpvalue*, oldSize);
+  vm.openUpvalues = open;
+}
+
+static void growFrames() {
+  int oldCapacity = vm.frameCapacity;
+  vm.frameCapacity = GROW_CAPACITY(oldCapacity);
+  if (vm.frameCapacity > vm.maxFrames)
+    vm.frameCapacity = vm.maxFrames;
+  vm.frames =
+      GROW_ARRAY(vm.frames, CallFrame, oldCapacity, vm.frameCapacity);
+}
+
+void runtimeError(const char* format, ...) {
   va_list args;
   va_start(args, format);
   vfprintf(stderr, format, args);
@@ -40,10 +161,17 @@ static void runtimeError(const char* format, ...) {
   for (int i = vm.frameCount - 1; i >= 0; i--) {
     CallFrame* frame = &vm.frames[i];
     ObjFunction* function = frame->closure->function;
-    // -1 because the IP is sitting on the next instruction to be
-    // executed.
-    size_t instruction = frame->ip - function->chunk.code - 1;
-    fprintf(stderr, "[line %d] in ", function->chunk.lines[instruction]);
+    int line;
+    if (vm.registerMode) {
+      RegChunk* code = &function->registerCode;
+      line = code->lines[frame->pc - code->code - 1];
+    } else {
+      // -1 because the IP is sitting on the next instruction to be
+      // executed.
+      size_t instruction = frame->ip - function->chunk.code - 1;
+      line = function->chunk.lines[instruction];
+    }
+    fprintf(stderr, "[line %d] in ", line);
     if (function->name == NULL) {
       fprintf(stderr, "script\n");
     } else {
@@ -51,37 +179,99 @@ static void runtimeError(const char* format, ...) {
     }
   }
 
-  initValueStack(&vm.stack, STACK_SIZE);
+  resetStack();
+}
+
+// returns the slot of the global variable called "name", giving it a
+// new (undefined) slot the first time the name is seen.
+int declareGlobal(ObjString* name) {
+  Value slot;
+  if (tableGet(&vm.globalSlots, name, &slot)) {
+    return (int)AS_NUMBER(slot);
+  }
+
+  // keep the name reachable while the arrays grow.
+  push(OBJ_VAL(name));
+  int index = vm.globalValues.count;
+  writeValueArray(&vm.globalValues, UNDEFINED_VAL);
+  writeValueArray(&vm.globalNames, OBJ_VAL(name));
+  tableSet(&vm.globalSlots, name, NUMBER_VAL((double)index));
+  pop();
+  return index;
 }
 
 static void defineNative(const char* name, NativeFn function) {
   push(OBJ_VAL(copyString(name, (int)strlen(name))));
   push(OBJ_VAL(newNative(function)));
-  tableSet(&vm.globals, AS_STRING(vm.stack.values[0]), vm.stack.values[1]);
+  int slot = declareGlobal(AS_STRING(vm.stack.values[0]));
+  vm.globalValues.values[slot] = vm.stack.values[1];
   pop();
   pop();
 }
 
 void initVM() {
-  initValueStack(&vm.stack, STACK_SIZE);
+  vm.bytesAllocated = 0;
+  vm.nextGC = GC_HEAP_MIN;
+  initNursery();
+  initValueStack(&vm.stack, STACK_INITIAL);
+  vm.openUpvalues = ALLOCATE(ObjUpvalue*, STACK_INITIAL);
+  memset(vm.openUpvalues, 0, sizeof(ObjUpvalue*) * STACK_INITIAL);
+  vm.openTop = 0;
   initTable(&vm.strings);
-  initTable(&vm.globals);
+  initTable(&vm.globalSlots);
+  initValueArray(&vm.globalNames);
+  initValueArray(&vm.globalValues);
   vm.objects = NULL;
+  vm.objectCount = 0;
+  vm.objectCapacity = 0;
+  for (int i = 0; i < SLAB_CLASSES; i++) {
+    vm.pages[i] = NULL;
+    vm.available[i] = NULL;
+  }
+  vm.sparePages = NULL;
+  vm.spareCount = 0;
+  vm.frames = NULL;
   vm.frameCount = 0;
-  vm.openUpvalues = NULL;
+  vm.frameCapacity = 0;
+  vm.maxFrames = FRAMES_MAX;
 
   vm.grayCapacity = 0;
   vm.grayCount = 0;
   vm.grayStack = NULL;
+  vm.heapGrowFactor = GC_HEAP_GROW_FACTOR;
+  vm.gcIncremental = false;
+  vm.gcPhase = GC_IDLE;
+  vm.gcStepObjects = GC_STEP_OBJECTS;
+  vm.gcStepDebt = 0;
+  vm.gcThreads = 1;
+  vm.gcConcurrent = false;
+  vm.compactPending = false;
+  vm.compactThreshold = 0;
+  vm.registerMode = false;
+#ifdef JIT
+  vm.jitEnabled = true;
+#else
+  vm.jitEnabled = false;
+#endif
 
   defineNative("clock", clockNative);
+  defineNative("compactHeap", compactHeapNative);
 }
 
 void freeVM() {
+#ifdef DEBUG_PROFILE_OPCODES
+  printOpcodeProfile();
+#endif
+  FREE_ARRAY(vm.openUpvalues, ObjUpvalue*, vm.stack.size);
   freeValueStack(&vm.stack);
+  FREE_ARRAY(vm.frames, CallFrame, vm.frameCapacity);
   freeTable(&vm.strings);
-  freeTable(&vm.globals);
+  freeTable(&vm.globalSlots);
+  freeValueArray(&vm.globalNames);
+  freeValueArray(&vm.globalValues);
+  stopMarking();
   freeObjects();
+  freeNursery();
   free(vm.grayStack);
 }
 
@@ -91,9 +281,7 @@ static bool isFalsey(Value value) {
   return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
 
-static void concatenate() {
-  ObjString* b = AS_STRING(pop());
-  ObjString* a = AS_STRING(pop());
+ObjString* joinStrings(ObjString* a, ObjString* b) {
   int len = b->length + a->length;
   ObjString* result = xallocateString(len);
 
@@ -105,10 +293,33 @@ static void concatenate() {
     result->chars[a->length + i] = b->chars[i];
   }
 
-  result = validateString(result);
+  return validateString(result);
+}
+
+static void concatenate() {
+  // the operands stay on the stack while the
+  // result is allocated, it may run the GC.
+  ObjString* b = AS_STRING(peek(0));
+  ObjString* a = AS_STRING(peek(1));
+  ObjString* result = joinStrings(a, b);
+  pop();
+  pop();
   push(OBJ_VAL(result));
 }
 
+// counts a call or a loop back-edge, compiles
+// the function once it gets to JIT_THRESHOLD.
+static inline void profileHot(ObjFunction* function) {
+#ifdef JIT
+  if (vm.jitEnabled && function->jit == NULL &&
+      ++function->hotness == JIT_THRESHOLD) {
+    compileJit(function);
+  }
+#else
+  (void)function;
+#endif
+}
+
 static bool call(ObjClosure* closure, int argCount) {
   if (argCount != closure->function->arity) {
     runtimeError("Expected %d arguments but got %d.", closure->function->arity,
@@ -116,16 +327,33 @@ static bool call(ObjClosure* closure, int argCount) {
     return false;
   }
 
-  if (vm.frameCount == FRAMES_MAX) {
+  if (vm.frameCount == vm.maxFrames) {
     runtimeError("Stack overflow.");
     return false;
   }
+  if (vm.frameCount == vm.frameCapacity) {
+    growFrames();
+  }
+  // run() pushes without bounds checks, make sure the callee's
+  // whole frame fits once here instead. the stack may move.
+  int frameSize = closure->function->maxStack;
+  if (vm.registerMode &&
+      closure->function->registerCode.registerCount > frameSize) {
+    frameSize = closure->function->registerCode.registerCount;
+  }
+  size_t needed =
+      vm.stack.top - argCount - 1 - vm.stack.values + (size_t)frameSize;
+  if (needed > vm.stack.size) {
+    growStack(needed);
+  }
 
   CallFrame* frame = &vm.frames[vm.frameCount++];
   frame->closure = closure;
   frame->ip = closure->function->chunk.code;
+  frame->pc = closure->function->registerCode.code;
 
   frame->slots = vm.stack.top - argCount - 1;
+  profileHot(closure->function);
 
   return true;
 }
@@ -152,277 +380,967 @@ static bool callValue(Value callee, int argCount) {
   return false;
 }
 
-static ObjUpvalue* captureValue(Value* local) {
-  ObjUpvalue* prev = NULL;
-  ObjUpvalue* current = vm.openUpvalues;
-
-  while (current != NULL && current->slot > local) {
-    prev = current;
-    current = current->next;
-  }
+ObjUpvalue* captureValue(Value* local) {
+  int slot = (int)(local - vm.stack.values);
   // if the upvalue has already been captured, return
   // it.
-  if (current != NULL && current->slot == local) {
-    return current;
-  }
+  if (vm.openUpvalues[slot] != NULL) return vm.openUpvalues[slot];
 
+  // newUpvalue() may collect, which only reads the table.
   ObjUpvalue* createdUpvalue = newUpvalue(local);
-  createdUpvalue->next = current;
-
-  if (prev == NULL) {
-    vm.openUpvalues = createdUpvalue;
-  } else {
-    prev->next = createdUpvalue;
-  }
-
+  vm.openUpvalues[slot] = createdUpvalue;
+  if (slot >= vm.openTop) vm.openTop = slot + 1;
   return createdUpvalue;
 }
 
-static void closeUpvalues(Value* last) {
-  while (vm.openUpvalues != NULL && vm.openUpvalues->slot >= last) {
-    ObjUpvalue* upval = vm.openUpvalues;
+void closeUpvalues(Value* last) {
+  int from = (int)(last - vm.stack.values);
+  for (int slot = vm.openTop - 1; slot >= from; slot--) {
+    ObjUpvalue* upval = vm.openUpvalues[slot];
+    if (upval == NULL) continue;
     upval->closed = *upval->slot;
     upval->slot = &upval->closed;
-    vm.openUpvalues = upval->next;
+    writeBarrier((Obj*)upval, upval->closed);
+    vm.openUpvalues[slot] = NULL;
   }
+  if (from < vm.openTop) vm.openTop = from;
 }
 
 static InterpretResult run() {
+  // the hot state of the current frame lives in locals so the compiler
+  // can keep it in registers. it is only written back to the CallFrame
+  // and vm.stack around calls, returns, allocations (which may trigger
+  // the GC) and runtime errors.
+  CallFrame* frame;
+  uint8_t* ip;
+  Value* slots;
+  Value* constants;
+  Value* stackTop = vm.stack.top;
+
+#define LOAD_FRAME()                                                           \
+  do {                                                                         \
+    frame = &vm.frames[vm.frameCount - 1];                                     \
+    ip = frame->ip;                                                            \
+    slots = frame->slots;                                                      \
+    constants = frame->closure->function->chunk.constants.values;              \
+  } while (false)
+
+#define STORE_FRAME()                                                          \
+  do {                                                                         \
+    frame->ip = ip;                                                            \
+    vm.stack.top = stackTop;                                                   \
+  } while (false)
+
+#define RUNTIME_ERROR(...)                                                     \
+  do {                                                                         \
+    STORE_FRAME();                                                             \
+    runtimeError(__VA_ARGS__);                                                 \
+    return INTERPRET_RUNTIME_ERROR;                                            \
+  } while (false)
+
+  // call() makes room for the function's maxStack slots, so pushes
+  // inside the loop are plain stores. the stack only moves in call(),
+  // slots and stackTop are reloaded after every call.
+#define PUSH(value) (*stackTop++ = (value))
+#define POP() (*--stackTop)
+#define PEEK(distance) (stackTop[-1 - (distance)])
+
 #define BINARY_OP(valueType, op)                                               \
   do {                                                                         \
-    if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) {                          \
-      runtimeError("Operands must be numbers.");                               \
-      return INTERPRET_RUNTIME_ERROR;                                          \
+    if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) {                          \
+      RUNTIME_ERROR("Operands must be numbers.");                              \
     }                                                                          \
-    double b = AS_NUMBER(pop());                                               \
-    double a = AS_NUMBER(pop());                                               \
-    push(valueType(a op b));                                                   \
+    double b = AS_NUMBER(POP());                                               \
+    double a = AS_NUMBER(POP());                                               \
+    PUSH(valueType(a op b));                                                   \
   } while (false)
 
-  CallFrame* frame = &vm.frames[vm.frameCount - 1];
+  // runs the frame's machine code, if it has any, from ip
+  // on until it hands the current instruction back.
+#ifdef JIT
+#define ENTER_JIT()                                                            \
+  do {                                                                         \
+    ObjFunction* function = frame->closure->function;                          \
+    if (function->jit != NULL) {                                               \
+      int offset = runJit(frame->closure, slots,                               \
+                          (int)(ip - function->chunk.code));                   \
+      ip = function->chunk.code + offset;                                      \
+      stackTop = slots + function->jit->depths[offset];                        \
+    }                                                                          \
+  } while (false)
+#else
+#define ENTER_JIT() ((void)0)
+#endif
+
+  // a minor collection moves the young objects, a compaction the old
+  // ones. they run between instructions where every live one is on
+  // the stack and only the frames hold the closures.
+#define SAFEPOINT()                                                            \
+  do {                                                                         \
+    if (safepointDue()) {                                                      \
+      STORE_FRAME();                                                           \
+      gcSafepoint();                                                           \
+    }                                                                          \
+  } while (false)
 
-#define READ_BYTE() (*(frame->ip++))
-#define READ_CONSTANT()                                                        \
-  (frame->closure->function->chunk.constants.values[READ_BYTE()])
+#define READ_BYTE() (*ip++)
+#define READ_CONSTANT() (constants[READ_BYTE()])
 #define READ_STRING() (AS_STRING(READ_CONSTANT()))
-#define READ_SHORT()                                                           \
-  (frame->ip += 2, (uint16_t)((frame->ip[-2] << 8) | (frame->ip[-1])))
-  while (true) {
+#define GLOBAL_NAME(slot) (AS_CSTRING(vm.globalNames.values[slot]))
+#define READ_SHORT() (ip += 2, (uint16_t)((ip[-2] << 8) | (ip[-1])))
+
 #ifdef DEBUG_TRACE_EXECTUION
-    printStack();
-    disassembleInstruction(
-        &frame->closure->function->chunk,
-        (int)(frame->ip - frame->closure->function->chunk.code));
+#define TRACE_INSTRUCTION()                                                    \
+  do {                                                                         \
+    STORE_FRAME();                                                             \
+    printStack();                                                              \
+    disassembleInstruction(                                                    \
+        &frame->closure->function->chunk,                                      \
+        (int)(ip - frame->closure->function->chunk.code));                     \
+  } while (false)
+#else
+#define TRACE_INSTRUCTION() ((void)0)
 #endif
+
+#ifdef DEBUG_PROFILE_OPCODES
+#define PROFILE_INSTRUCTION() profileOpcode(*ip)
+#else
+#define PROFILE_INSTRUCTION() ((void)0)
+#endif
+
+  // with COMPUTED_GOTO every handler jumps straight to the handler of
+  // the next opcode, so each opcode gets its own indirect branch instead
+  // of all of them sharing the one at the top of the switch.
+#ifdef COMPUTED_GOTO
+  static void* dispatchTable[] = {
+      [OP_RETURN] = &&op_OP_RETURN,
+      [OP_CONSTANT] = &&op_OP_CONSTANT,
+      [OP_NIL] = &&op_OP_NIL,
+      [OP_NOT] = &&op_OP_NOT,
+      [OP_TRUE] = &&op_OP_TRUE,
+      [OP_FALSE] = &&op_OP_FALSE,
+      [OP_EQUAL] = &&op_OP_EQUAL,
+      [OP_LESS] = &&op_OP_LESS,
+      [OP_GREATER] = &&op_OP_GREATER,
+      [OP_NEGATE] = &&op_OP_NEGATE,
+      [OP_MULT] = &&op_OP_MULT,
+      [OP_DIV] = &&op_OP_DIV,
+      [OP_ADD] = &&op_OP_ADD,
+      [OP_SUB] = &&op_OP_SUB,
+      [OP_PRINT] = &&op_OP_PRINT,
+      [OP_POP] = &&op_OP_POP,
+      [OP_POPN] = &&op_OP_POPN,
+      [OP_DEFINE_GLOBAL] = &&op_OP_DEFINE_GLOBAL,
+      [OP_GET_GLOBAL] = &&op_OP_GET_GLOBAL,
+      [OP_SET_GLOBAL] = &&op_OP_SET_GLOBAL,
+      [OP_SET_LOCAL] = &&op_OP_SET_LOCAL,
+      [OP_GET_LOCAL] = &&op_OP_GET_LOCAL,
+      [OP_JUMPZ] = &&op_OP_JUMPZ,
+      [OP_JUMP] = &&op_OP_JUMP,
+      [OP_LOOP] = &&op_OP_LOOP,
+      [OP_CALL] = &&op_OP_CALL,
+      [OP_TAIL_CALL] = &&op_OP_TAIL_CALL,
+      [OP_CLOSURE] = &&op_OP_CLOSURE,
+      [OP_GET_UPVALUE] = &&op_OP_GET_UPVALUE,
+      [OP_SET_UPVALUE] = &&op_OP_SET_UPVALUE,
+      [OP_CLOSE_UPVALUES] = &&op_OP_CLOSE_UPVALUES,
+      [OP_STACK_CLOSURE] = &&op_OP_STACK_CLOSURE,
+      [OP_GET_ENCLOSING] = &&op_OP_GET_ENCLOSING,
+      [OP_SET_ENCLOSING] = &&op_OP_SET_ENCLOSING,
+      [OP_GET_FLAT_UPVALUE] = &&op_OP_GET_FLAT_UPVALUE,
+      [OP_NOT_EQUAL] = &&op_OP_NOT_EQUAL,
+      [OP_ADD_LOCALS] = &&op_OP_ADD_LOCALS,
+      [OP_POP_JUMPZ] = &&op_OP_POP_JUMPZ,
+      [OP_LESS_LOCAL_CONST_JUMPZ] = &&op_OP_LESS_LOCAL_CONST_JUMPZ,
+      [OP_SET_LOCAL_POP] = &&op_OP_SET_LOCAL_POP,
+  };
+
+#define CASE(opcode)                                                           \
+  case opcode:                                                                 \
+  op_##opcode:
+#define DISPATCH()                                                             \
+  do {                                                                         \
+    TRACE_INSTRUCTION();                                                       \
+    PROFILE_INSTRUCTION();                                                     \
+    goto* dispatchTable[READ_BYTE()];                                          \
+  } while (false)
+#else
+#define CASE(opcode) case opcode:
+#define DISPATCH() break
+#endif
+
+  LOAD_FRAME();
+
+  // the switch only decodes the very first instruction when dispatching
+  // through the table, every handler after that jumps to the next one.
+  while (true) {
+    TRACE_INSTRUCTION();
+    PROFILE_INSTRUCTION();
     uint8_t instruction = READ_BYTE();
     Value valA, valB;
     switch (instruction) {
-    case OP_RETURN: {
-      Value result = pop();
-      closeUpvalues(frame->slots);
+    CASE(OP_RETURN) {
+      Value result = POP();
+      closeUpvalues(slots);
       vm.frameCount--;
 
       if (vm.frameCount == 0) {
-        pop();
+        vm.stack.top = slots;
         return INTERPRET_OK;
       }
 
-      vm.stack.top = frame->slots;
-      push(result);
+      stackTop = slots;
+      PUSH(result);
 
-      frame = &vm.frames[vm.frameCount - 1];
-      break;
+      LOAD_FRAME();
+      ENTER_JIT();
+      DISPATCH();
     }
-    case OP_CONSTANT: {
+    CASE(OP_CONSTANT) {
       Value constant = READ_CONSTANT();
-      push(constant);
-      break;
+      PUSH(constant);
+      DISPATCH();
     }
-    case OP_NEGATE:
-      if (!IS_NUMBER(peek(0))) {
-        runtimeError("Operand must be a number.");
-        return INTERPRET_RUNTIME_ERROR;
+    CASE(OP_NEGATE)
+      if (!IS_NUMBER(PEEK(0))) {
+        RUNTIME_ERROR("Operand must be a number.");
       }
-      push(NUMBER_VAL(-AS_NUMBER(pop())));
-      break;
-    case OP_MULT:
+      PEEK(0) = NUMBER_VAL(-AS_NUMBER(PEEK(0)));
+      DISPATCH();
+    CASE(OP_MULT)
       BINARY_OP(NUMBER_VAL, *);
-      break;
-    case OP_ADD:
-      if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
+      DISPATCH();
+    CASE(OP_ADD)
+      if (IS_STRING(PEEK(0)) && IS_STRING(PEEK(1))) {
+        STORE_FRAME();
         concatenate();
-      } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
-        double b = AS_NUMBER(pop());
-        double a = AS_NUMBER(pop());
-        push(NUMBER_VAL(a + b));
+        stackTop = vm.stack.top;
+        SAFEPOINT();
+      } else if (IS_NUMBER(PEEK(0)) && IS_NUMBER(PEEK(1))) {
+        double b = AS_NUMBER(POP());
+        double a = AS_NUMBER(POP());
+        PUSH(NUMBER_VAL(a + b));
       } else {
-        runtimeError("Operands must be two numbers or two strings.");
-        return INTERPRET_RUNTIME_ERROR;
+        RUNTIME_ERROR("Operands must be two numbers or two strings.");
       }
-      break;
-    case OP_SUB:
+      DISPATCH();
+    CASE(OP_SUB)
       BINARY_OP(NUMBER_VAL, -);
-      break;
-    case OP_DIV:
+      DISPATCH();
+    CASE(OP_DIV)
       BINARY_OP(NUMBER_VAL, /);
-      break;
-    case OP_NIL:
-      push(NIL_VAL);
-      break;
+      DISPATCH();
+    CASE(OP_NIL)
+      PUSH(NIL_VAL);
+      DISPATCH();
     // having OP_TRUE
     // and OP_FALSE is cheaper
     // than storing them as value structs
     // in the chunk's constant pool.
-    case OP_TRUE:
-      push(BOOL_VAL(true));
-      break;
-    case OP_FALSE:
-      push(BOOL_VAL(false));
-      break;
-    case OP_GREATER:
+    CASE(OP_TRUE)
+      PUSH(BOOL_VAL(true));
+      DISPATCH();
+    CASE(OP_FALSE)
+      PUSH(BOOL_VAL(false));
+      DISPATCH();
+    CASE(OP_GREATER)
       BINARY_OP(BOOL_VAL, >);
-      break;
-    case OP_LESS:
+      DISPATCH();
+    CASE(OP_LESS)
       BINARY_OP(BOOL_VAL, <);
-      break;
-    case OP_EQUAL:
-      valA = pop();
-      valB = pop();
-      push(BOOL_VAL(valuesEqual(valA, valB)));
-      break;
-    case OP_NOT:
-      push(BOOL_VAL(isFalsey(pop())));
-      break;
-    case OP_PRINT:
-      printValue(pop());
+      DISPATCH();
+    CASE(OP_EQUAL)
+      valA = POP();
+      valB = POP();
+      PUSH(BOOL_VAL(valuesEqual(valA, valB)));
+      DISPATCH();
+    CASE(OP_NOT)
+      PEEK(0) = BOOL_VAL(isFalsey(PEEK(0)));
+      DISPATCH();
+    CASE(OP_PRINT)
+      printValue(POP());
       printf("\n");
-      break;
-    case OP_POP:
-      pop();
-      break;
-    case OP_POPN: {
+      DISPATCH();
+    CASE(OP_POP)
+      stackTop--;
+      DISPATCH();
+    CASE(OP_POPN) {
       uint8_t count = READ_BYTE();
-      while (count--)
-        pop();
-      break;
+      stackTop -= count;
+      DISPATCH();
     }
-    case OP_DEFINE_GLOBAL: {
-      // peek becausesomething something garbage collection
-      ObjString* name = READ_STRING();
-      tableSet(&vm.globals, name, peek(0));
-      pop();
-      break;
+    // the global opcodes take a 16 bit slot number
+    // into vm.globalValues that the compiler resolved.
+    CASE(OP_DEFINE_GLOBAL) {
+      uint16_t slot = READ_SHORT();
+      vm.globalValues.values[slot] = POP();
+      DISPATCH();
     }
 
-    case OP_GET_GLOBAL: {
-      ObjString* name = READ_STRING();
-      Value value;
-      if (!tableGet(&vm.globals, name, &value)) {
-        runtimeError("Undefined global '%s'.", name->chars);
-        return INTERPRET_RUNTIME_ERROR;
+    CASE(OP_GET_GLOBAL) {
+      uint16_t slot = READ_SHORT();
+      Value value = vm.globalValues.values[slot];
+      if (IS_UNDEFINED(value)) {
+        RUNTIME_ERROR("Undefined global '%s'.", GLOBAL_NAME(slot));
       }
-      push(value);
-      break;
+      PUSH(value);
+      DISPATCH();
     }
 
-    case OP_SET_GLOBAL: {
-      ObjString* name = READ_STRING();
-      // if the hash table doesn't already have a string
-      // going by that name then it creates a new key
-      // and then retruns true (isNewKey). Then we know
-      // that the global wasn't already defined and throw an
-      // error
-      if (tableSet(&vm.globals, name, peek(0))) {
-        tableDelete(&vm.globals, name);
-        runtimeError("Undefined variable '%s'.", name->chars);
-        return INTERPRET_RUNTIME_ERROR;
+    CASE(OP_SET_GLOBAL) {
+      uint16_t slot = READ_SHORT();
+      // the slot exists as soon as the name is compiled,
+      // assigning to it is an error until it is defined.
+      if (IS_UNDEFINED(vm.globalValues.values[slot])) {
+        RUNTIME_ERROR("Undefined variable '%s'.", GLOBAL_NAME(slot));
       }
-      break;
+      vm.globalValues.values[slot] = PEEK(0);
+      DISPATCH();
     }
 
-    case OP_GET_LOCAL: {
+    CASE(OP_GET_LOCAL) {
       uint8_t slot = READ_BYTE();
-      push(frame->slots[slot]);
-      break;
+      PUSH(slots[slot]);
+      DISPATCH();
     }
 
-    case OP_SET_LOCAL: {
+    CASE(OP_SET_LOCAL) {
       uint8_t slot = READ_BYTE();
-      frame->slots[slot] = peek(0);
-      break;
+      slots[slot] = PEEK(0);
+      DISPATCH();
     }
 
-    case OP_GET_UPVALUE: {
+    CASE(OP_GET_UPVALUE) {
       uint8_t index = READ_BYTE();
-      ObjUpvalue* upval = frame->closure->upvalues[index];
-      push(*frame->closure->upvalues[index]->slot);
-      break;
+      PUSH(*AS_UPVALUE(frame->closure->upvalues[index])->slot);
+      DISPATCH();
     }
 
-    case OP_SET_UPVALUE: {
+    CASE(OP_GET_FLAT_UPVALUE) {
       uint8_t index = READ_BYTE();
-      *frame->closure->upvalues[index]->slot = peek(0);
-      break;
+      PUSH(frame->closure->upvalues[index]);
+      DISPATCH();
     }
 
-    case OP_JUMPZ: {
+    CASE(OP_SET_UPVALUE) {
+      ObjUpvalue* upvalue = AS_UPVALUE(frame->closure->upvalues[READ_BYTE()]);
+      preWriteBarrier(*upvalue->slot);
+      *upvalue->slot = PEEK(0);
+      writeBarrier((Obj*)upvalue, PEEK(0));
+      DISPATCH();
+    }
+
+    CASE(OP_JUMPZ) {
       uint16_t offset = READ_SHORT();
-      if (isFalsey(peek(0)))
-        frame->ip += offset;
-      break;
+      if (isFalsey(PEEK(0)))
+        ip += offset;
+      DISPATCH();
     }
 
-    case OP_JUMP: {
+    CASE(OP_JUMP) {
       uint16_t offset = READ_SHORT();
-      frame->ip += offset;
-      break;
+      ip += offset;
+      DISPATCH();
     }
 
-    case OP_LOOP: {
+    CASE(OP_LOOP) {
       uint16_t offset = READ_SHORT();
-      frame->ip -= offset;
-      break;
+      ip -= offset;
+      SAFEPOINT();
+      profileHot(frame->closure->function);
+      ENTER_JIT();
+      DISPATCH();
     }
 
-    case OP_CALL: {
+    CASE(OP_CALL) {
       int argCount = READ_BYTE();
-
-      if (!callValue(peek(argCount), argCount)) {
+      STORE_FRAME();
+      if (!callValue(PEEK(argCount), argCount)) {
         return INTERPRET_RUNTIME_ERROR;
       }
-      frame = &vm.frames[vm.frameCount - 1];
-      break;
+      LOAD_FRAME();
+      stackTop = vm.stack.top;
+      SAFEPOINT();
+      ENTER_JIT();
+      DISPATCH();
+    }
+
+    CASE(OP_TAIL_CALL) {
+      int argCount = READ_BYTE();
+      Value callee = PEEK(argCount);
+      if (!IS_CLOSURE(callee) ||
+          AS_CLOSURE(callee)->function->arity != argCount) {
+        // a native (or an error) makes an ordinary call,
+        // the OP_RETURN after this returns its result.
+        STORE_FRAME();
+        if (!callValue(callee, argCount)) {
+          return INTERPRET_RUNTIME_ERROR;
+        }
+        stackTop = vm.stack.top;
+        DISPATCH();
+      }
+
+      // the callee and its arguments replace this frame's slots. its
+      // frame may be bigger than this one, the stack may move.
+      ObjClosure* closure = AS_CLOSURE(callee);
+      size_t needed = slots - vm.stack.values + closure->function->maxStack;
+      if (needed > vm.stack.size) {
+        STORE_FRAME();
+        growStack(needed);
+        slots = frame->slots;
+        stackTop = vm.stack.top;
+      }
+      closeUpvalues(slots);
+      Value* args = stackTop - argCount - 1;
+      for (int i = 0; i <= argCount; i++) {
+        slots[i] = args[i];
+      }
+      stackTop = slots + argCount + 1;
+      frame->closure = closure;
+      ip = closure->function->chunk.code;
+      constants = closure->function->chunk.constants.values;
+      profileHot(closure->function);
+      ENTER_JIT();
+      DISPATCH();
     }
 
-    case OP_CLOSURE: {
+    CASE(OP_CLOSURE) {
       ObjFunction* function = AS_FUNCTION(READ_CONSTANT());
+      STORE_FRAME();
       ObjClosure* closure = newClosure(function);
-      push(OBJ_VAL(closure));
+      PUSH(OBJ_VAL(closure));
+      vm.stack.top = stackTop;
       for (int i = 0; i < closure->upvalueCount; i++) {
-        uint8_t isLocal = READ_BYTE();
+        uint8_t kind = READ_BYTE();
         uint8_t index = READ_BYTE();
-        if (isLocal) {
-          closure->upvalues[i] = captureValue(frame->slots + index);
+        if (kind == CAPTURE_LOCAL) {
+          closure->upvalues[i] = OBJ_VAL(captureValue(slots + index));
+        } else if (kind == CAPTURE_VALUE) {
+          closure->upvalues[i] = slots[index];
         } else {
-          closure->upvalues[i] = frame->closure->upvalues[i];
+          closure->upvalues[i] = frame->closure->upvalues[index];
         }
+        writeBarrier((Obj*)closure, closure->upvalues[i]);
       }
-      break;
+      SAFEPOINT();
+      DISPATCH();
     }
 
-    case OP_CLOSE_UPVALUE: {
-      closeUpvalues(vm.stack.top - 1);
-      pop();
-      break;
+    CASE(OP_CLOSE_UPVALUES) {
+      stackTop -= READ_BYTE();
+      closeUpvalues(stackTop);
+      DISPATCH();
+    }
+
+    CASE(OP_STACK_CLOSURE) {
+      ObjClosure* closure = AS_CLOSURE(READ_CONSTANT());
+      PUSH(OBJ_VAL(closure));
+      ip += 2 * closure->function->upvalueCount;
+      DISPATCH();
+    }
+
+    // the function that declares a stack closure is the only one that
+    // calls it, its frame is the one below.
+    CASE(OP_GET_ENCLOSING) {
+      uint8_t slot = READ_BYTE();
+      PUSH((frame - 1)->slots[slot]);
+      DISPATCH();
+    }
+
+    CASE(OP_SET_ENCLOSING) {
+      uint8_t slot = READ_BYTE();
+      (frame - 1)->slots[slot] = PEEK(0);
+      DISPATCH();
+    }
+
+    CASE(OP_NOT_EQUAL)
+      valA = POP();
+      valB = POP();
+      PUSH(BOOL_VAL(!valuesEqual(valA, valB)));
+      DISPATCH();
+
+    CASE(OP_ADD_LOCALS) {
+      valA = slots[READ_BYTE()];
+      valB = slots[READ_BYTE()];
+      if (IS_NUMBER(valA) && IS_NUMBER(valB)) {
+        PUSH(NUMBER_VAL(AS_NUMBER(valA) + AS_NUMBER(valB)));
+      } else if (IS_STRING(valA) && IS_STRING(valB)) {
+        // the operands are locals, the stack keeps them alive.
+        STORE_FRAME();
+        ObjString* result = joinStrings(AS_STRING(valA), AS_STRING(valB));
+        PUSH(OBJ_VAL(result));
+        SAFEPOINT();
+      } else {
+        RUNTIME_ERROR("Operands must be two numbers or two strings.");
+      }
+      DISPATCH();
+    }
+
+    CASE(OP_POP_JUMPZ) {
+      uint16_t offset = READ_SHORT();
+      if (isFalsey(POP()))
+        ip += offset;
+      DISPATCH();
+    }
+
+    CASE(OP_LESS_LOCAL_CONST_JUMPZ) {
+      valA = slots[READ_BYTE()];
+      valB = READ_CONSTANT();
+      uint16_t offset = READ_SHORT();
+      if (!IS_NUMBER(valA) || !IS_NUMBER(valB)) {
+        RUNTIME_ERROR("Operands must be numbers.");
+      }
+      if (!(AS_NUMBER(valA) < AS_NUMBER(valB)))
+        ip += offset;
+      DISPATCH();
+    }
+
+    CASE(OP_SET_LOCAL_POP) {
+      uint8_t slot = READ_BYTE();
+      slots[slot] = POP();
+      DISPATCH();
     }
     }
   }
 
+#undef CASE
+#undef DISPATCH
+#undef TRACE_INSTRUCTION
+#undef PROFILE_INSTRUCTION
 #undef READ_CONSTANT
 #undef READ_BYTE
 #undef READ_STRING
+#undef GLOBAL_NAME
 #undef READ_SHORT
 #undef BINARY_OP
+#undef ENTER_JIT
+#undef SAFEPOINT
+#undef PUSH
+#undef POP
+#undef PEEK
+#undef RUNTIME_ERROR
+#undef STORE_FRAME
+#undef LOAD_FRAME
+}
+
+// sets vm.stack.top for the register frame that was just pushed,
+// "top" is the top its caller runs with. the GC marks every register
+// below vm.stack.top, so the registers a frame adds above its
+// caller's are cleared first, and the top never drops below the
+// caller's registers while the call runs.
+static void enterRegisterFrame(Value* top) {
+  CallFrame* frame = &vm.frames[vm.frameCount - 1];
+  Value* end =
+      frame->slots + frame->closure->function->registerCode.registerCount;
+  while (top < end) {
+    *top++ = NIL_VAL;
+  }
+  frame->top = top;
+  vm.stack.top = top;
+}
+
+// the loop for the register code (clox --register). it mirrors run(),
+// values are read from the frame's registers or the constant pool
+// instead of being pushed and popped.
+static InterpretResult runRegisters() {
+  CallFrame* frame;
+  uint32_t* pc;
+  Value* slots;
+  Value* constants;
+  uint32_t instruction;
+
+#define LOAD_FRAME()                                                           \
+  do {                                                                         \
+    frame = &vm.frames[vm.frameCount - 1];                                     \
+    pc = frame->pc;                                                            \
+    slots = frame->slots;                                                      \
+    constants = frame->closure->function->chunk.constants.values;              \
+  } while (false)
+
+#define STORE_FRAME() (frame->pc = pc)
+
+#define RUNTIME_ERROR(...)                                                     \
+  do {                                                                         \
+    STORE_FRAME();                                                             \
+    runtimeError(__VA_ARGS__);                                                 \
+    return INTERPRET_RUNTIME_ERROR;                                            \
+  } while (false)
+
+  // vm.stack.top is the frame's top, the
+  // registers are roots for a minor collection.
+#define SAFEPOINT()                                                            \
+  do {                                                                         \
+    if (safepointDue()) {                                                      \
+      STORE_FRAME();                                                           \
+      gcSafepoint();                                                           \
+    }                                                                          \
+  } while (false)
+
+#define RK(operand)                                                            \
+  (REG_IS_K(operand) ? constants[(operand)&0xff] : slots[operand])
+#define RA() (slots[REG_A(instruction)])
+#define RKB() RK(REG_B(instruction))
+#define RKC() RK(REG_C(instruction))
+#define GLOBAL_NAME(slot) (AS_CSTRING(vm.globalNames.values[slot]))
+
+#define BINARY_OP(valueType, op)                                               \
+  do {                                                                         \
+    Value b = RKB();                                                           \
+    Value c = RKC();                                                           \
+    if (!IS_NUMBER(b) || !IS_NUMBER(c)) {                                      \
+      RUNTIME_ERROR("Operands must be numbers.");                              \
+    }                                                                          \
+    RA() = valueType(AS_NUMBER(b) op AS_NUMBER(c));                            \
+  } while (false)
+
+  // the jump offset is the word after the instruction.
+#define COMPARE_JUMPZ(condition)                                               \
+  do {                                                                         \
+    int32_t offset = (int32_t)*pc++;                                           \
+    if (!(condition))                                                          \
+      pc += offset;                                                            \
+  } while (false)
+
+#define NUMBER_COMPARE_JUMPZ(op)                                               \
+  do {                                                                         \
+    Value b = RKB();                                                           \
+    Value c = RKC();                                                           \
+    if (!IS_NUMBER(b) || !IS_NUMBER(c)) {                                      \
+      RUNTIME_ERROR("Operands must be numbers.");                              \
+    }                                                                          \
+    COMPARE_JUMPZ(AS_NUMBER(b) op AS_NUMBER(c));                               \
+  } while (false)
+
+#ifdef DEBUG_TRACE_EXECTUION
+#define TRACE_INSTRUCTION()                                                    \
+  do {                                                                         \
+    RegChunk* code = &frame->closure->function->registerCode;                  \
+    disassembleRegInstruction(code,                                            \
+                              &frame->closure->function->chunk.constants,      \
+                              (int)(pc - code->code));                         \
+  } while (false)
+#else
+#define TRACE_INSTRUCTION() ((void)0)
+#endif
+
+#ifdef DEBUG_PROFILE_OPCODES
+#define PROFILE_INSTRUCTION() (registerInstructions++)
+#else
+#define PROFILE_INSTRUCTION() ((void)0)
+#endif
+
+#ifdef COMPUTED_GOTO
+  static void* dispatchTable[] = {
+      [ROP_MOVE] = &&op_ROP_MOVE,
+      [ROP_LOADK] = &&op_ROP_LOADK,
+      [ROP_LOADNIL] = &&op_ROP_LOADNIL,
+      [ROP_LOADTRUE] = &&op_ROP_LOADTRUE,
+      [ROP_LOADFALSE] = &&op_ROP_LOADFALSE,
+      [ROP_GET_GLOBAL] = &&op_ROP_GET_GLOBAL,
+      [ROP_DEFINE_GLOBAL] = &&op_ROP_DEFINE_GLOBAL,
+      [ROP_SET_GLOBAL] = &&op_ROP_SET_GLOBAL,
+      [ROP_GET_UPVALUE] = &&op_ROP_GET_UPVALUE,
+      [ROP_SET_UPVALUE] = &&op_ROP_SET_UPVALUE,
+      [ROP_GET_ENCLOSING] = &&op_ROP_GET_ENCLOSING,
+      [ROP_SET_ENCLOSING] = &&op_ROP_SET_ENCLOSING,
+      [ROP_GET_FLAT] = &&op_ROP_GET_FLAT,
+      [ROP_ADD] = &&op_ROP_ADD,
+      [ROP_SUB] = &&op_ROP_SUB,
+      [ROP_MULT] = &&op_ROP_MULT,
+      [ROP_DIV] = &&op_ROP_DIV,
+      [ROP_EQUAL] = &&op_ROP_EQUAL,
+      [ROP_NOT_EQUAL] = &&op_ROP_NOT_EQUAL,
+      [ROP_LESS] = &&op_ROP_LESS,
+      [ROP_GREATER] = &&op_ROP_GREATER,
+      [ROP_NOT] = &&op_ROP_NOT,
+      [ROP_NEGATE] = &&op_ROP_NEGATE,
+      [ROP_PRINT] = &&op_ROP_PRINT,
+      [ROP_JUMP] = &&op_ROP_JUMP,
+      [ROP_JUMPZ] = &&op_ROP_JUMPZ,
+      [ROP_EQUAL_JUMPZ] = &&op_ROP_EQUAL_JUMPZ,
+      [ROP_NOT_EQUAL_JUMPZ] = &&op_ROP_NOT_EQUAL_JUMPZ,
+      [ROP_LESS_JUMPZ] = &&op_ROP_LESS_JUMPZ,
+      [ROP_GREATER_JUMPZ] = &&op_ROP_GREATER_JUMPZ,
+      [ROP_CALL] = &&op_ROP_CALL,
+      [ROP_TAIL_CALL] = &&op_ROP_TAIL_CALL,
+      [ROP_CLOSURE] = &&op_ROP_CLOSURE,
+      [ROP_CLOSE_UPVALUES] = &&op_ROP_CLOSE_UPVALUES,
+      [ROP_RETURN] = &&op_ROP_RETURN,
+  };
+
+#define CASE(opcode)                                                           \
+  case opcode:                                                                 \
+  op_##opcode:
+#define DISPATCH()                                                             \
+  do {                                                                         \
+    TRACE_INSTRUCTION();                                                       \
+    PROFILE_INSTRUCTION();                                                     \
+    instruction = *pc++;                                                       \
+    goto* dispatchTable[REG_OP(instruction)];                                  \
+  } while (false)
+#else
+#define CASE(opcode) case opcode:
+#define DISPATCH() break
+#endif
+
+  LOAD_FRAME();
+
+  while (true) {
+    TRACE_INSTRUCTION();
+    PROFILE_INSTRUCTION();
+    instruction = *pc++;
+    switch (REG_OP(instruction)) {
+    CASE(ROP_MOVE)
+      RA() = slots[REG_B(instruction)];
+      DISPATCH();
+    CASE(ROP_LOADK)
+      RA() = constants[REG_BX(instruction)];
+      DISPATCH();
+    CASE(ROP_LOADNIL)
+      RA() = NIL_VAL;
+      DISPATCH();
+    CASE(ROP_LOADTRUE)
+      RA() = BOOL_VAL(true);
+      DISPATCH();
+    CASE(ROP_LOADFALSE)
+      RA() = BOOL_VAL(false);
+      DISPATCH();
+    CASE(ROP_GET_GLOBAL) {
+      uint32_t slot = REG_BX(instruction);
+      Value value = vm.globalValues.values[slot];
+      if (IS_UNDEFINED(value)) {
+        RUNTIME_ERROR("Undefined global '%s'.", GLOBAL_NAME(slot));
+      }
+      RA() = value;
+      DISPATCH();
+    }
+    CASE(ROP_DEFINE_GLOBAL)
+      vm.globalValues.values[REG_BX(instruction)] = RA();
+      DISPATCH();
+    CASE(ROP_SET_GLOBAL) {
+      uint32_t slot = REG_BX(instruction);
+      if (IS_UNDEFINED(vm.globalValues.values[slot])) {
+        RUNTIME_ERROR("Undefined variable '%s'.", GLOBAL_NAME(slot));
+      }
+      vm.globalValues.values[slot] = RA();
+      DISPATCH();
+    }
+    CASE(ROP_GET_UPVALUE)
+      RA() = *AS_UPVALUE(frame->closure->upvalues[REG_B(instruction)])->slot;
+      DISPATCH();
+    CASE(ROP_GET_FLAT)
+      RA() = frame->closure->upvalues[REG_B(instruction)];
+      DISPATCH();
+    CASE(ROP_SET_UPVALUE) {
+      ObjUpvalue* upvalue =
+          AS_UPVALUE(frame->closure->upvalues[REG_A(instruction)]);
+      preWriteBarrier(*upvalue->slot);
+      *upvalue->slot = RKB();
+      writeBarrier((Obj*)upvalue, RKB());
+      DISPATCH();
+    }
+    CASE(ROP_GET_ENCLOSING)
+      RA() = (frame - 1)->slots[REG_B(instruction)];
+      DISPATCH();
+    CASE(ROP_SET_ENCLOSING)
+      (frame - 1)->slots[REG_A(instruction)] = RKB();
+      DISPATCH();
+    CASE(ROP_ADD) {
+      Value b = RKB();
+      Value c = RKC();
+      if (IS_NUMBER(b) && IS_NUMBER(c)) {
+        RA() = NUMBER_VAL(AS_NUMBER(b) + AS_NUMBER(c));
+      } else if (IS_STRING(b) && IS_STRING(c)) {
+        // both operands are in registers or constants,
+        // the GC sees them while the result is allocated.
+        RA() = OBJ_VAL(joinStrings(AS_STRING(b), AS_STRING(c)));
+        SAFEPOINT();
+      } else {
+        RUNTIME_ERROR("Operands must be two numbers or two strings.");
+      }
+      DISPATCH();
+    }
+    CASE(ROP_SUB)
+      BINARY_OP(NUMBER_VAL, -);
+      DISPATCH();
+    CASE(ROP_MULT)
+      BINARY_OP(NUMBER_VAL, *);
+      DISPATCH();
+    CASE(ROP_DIV)
+      BINARY_OP(NUMBER_VAL, /);
+      DISPATCH();
+    CASE(ROP_EQUAL)
+      RA() = BOOL_VAL(valuesEqual(RKB(), RKC()));
+      DISPATCH();
+    CASE(ROP_NOT_EQUAL)
+      RA() = BOOL_VAL(!valuesEqual(RKB(), RKC()));
+      DISPATCH();
+    CASE(ROP_LESS)
+      BINARY_OP(BOOL_VAL, <);
+      DISPATCH();
+    CASE(ROP_GREATER)
+      BINARY_OP(BOOL_VAL, >);
+      DISPATCH();
+    CASE(ROP_NOT)
+      RA() = BOOL_VAL(isFalsey(RKB()));
+      DISPATCH();
+    CASE(ROP_NEGATE) {
+      Value b = RKB();
+      if (!IS_NUMBER(b)) {
+        RUNTIME_ERROR("Operand must be a number.");
+      }
+      RA() = NUMBER_VAL(-AS_NUMBER(b));
+      DISPATCH();
+    }
+    CASE(ROP_PRINT)
+      printValue(RKB());
+      printf("\n");
+      DISPATCH();
+    CASE(ROP_JUMP)
+      pc += REG_SBX(instruction);
+      DISPATCH();
+    CASE(ROP_JUMPZ)
+      if (isFalsey(RA()))
+        pc += REG_SBX(instruction);
+      DISPATCH();
+    CASE(ROP_EQUAL_JUMPZ)
+      COMPARE_JUMPZ(valuesEqual(RKB(), RKC()));
+      DISPATCH();
+    CASE(ROP_NOT_EQUAL_JUMPZ)
+      COMPARE_JUMPZ(!valuesEqual(RKB(), RKC()));
+      DISPATCH();
+    CASE(ROP_LESS_JUMPZ)
+      NUMBER_COMPARE_JUMPZ(<);
+      DISPATCH();
+    CASE(ROP_GREATER_JUMPZ)
+      NUMBER_COMPARE_JUMPZ(>);
+      DISPATCH();
+    CASE(ROP_CALL) {
+    registerCall:;
+      Value* base = &RA();
+      int argCount = REG_B(instruction);
+      if (IS_CLOSURE(*base)) {
+        // the common case, pushed here without going through
+        // callValue().
+        ObjClosure* closure = AS_CLOSURE(*base);
+        RegChunk* code = &closure->function->registerCode;
+        if (argCount != closure->function->arity ||
+            vm.frameCount == vm.frameCapacity ||
+            base + code->registerCount > vm.stack.values + vm.stack.size)
+          goto slowCall;
+        STORE_FRAME();
+        Value* top = frame->top;
+        frame = &vm.frames[vm.frameCount++];
+        frame->closure = closure;
+        frame->slots = base;
+        frame->pc = pc = code->code;
+        slots = base;
+        constants = closure->function->chunk.constants.values;
+        Value* end = base + code->registerCount;
+        while (top < end) {
+          *top++ = NIL_VAL;
+        }
+        frame->top = top;
+        vm.stack.top = top;
+        DISPATCH();
+      }
+      if (IS_NATIVE(*base)) {
+        *base = AS_NATIVE(*base)(argCount, base + 1);
+        DISPATCH();
+      }
+    slowCall:
+      STORE_FRAME();
+      // call() takes the callee and the arguments
+      // from the top of the stack.
+      vm.stack.top = base + argCount + 1;
+      if (!callValue(*base, argCount)) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      // the frames may have moved, the caller is the one below.
+      enterRegisterFrame(vm.frames[vm.frameCount - 2].top);
+      LOAD_FRAME();
+      DISPATCH();
+    }
+    CASE(ROP_TAIL_CALL) {
+      Value* base = &RA();
+      int argCount = REG_B(instruction);
+      if (!IS_CLOSURE(*base)) {
+        // the ROP_RETURN after this returns the result.
+        goto registerCall;
+      }
+      ObjClosure* closure = AS_CLOSURE(*base);
+      RegChunk* code = &closure->function->registerCode;
+      if (argCount != closure->function->arity ||
+          slots + code->registerCount > vm.stack.values + vm.stack.size)
+        goto registerCall;
+
+      closeUpvalues(slots);
+      for (int i = 0; i <= argCount; i++) {
+        slots[i] = base[i];
+      }
+      frame->closure = closure;
+      frame->pc = pc = code->code;
+      constants = closure->function->chunk.constants.values;
+      enterRegisterFrame(frame->top);
+      DISPATCH();
+    }
+    CASE(ROP_CLOSURE) {
+      ObjFunction* function = AS_FUNCTION(constants[REG_BX(instruction)]);
+      ObjClosure* closure = newClosure(function);
+      RA() = OBJ_VAL(closure);
+      for (int i = 0; i < closure->upvalueCount; i++) {
+        uint32_t capture = *pc++;
+        uint8_t index = capture & 0xff;
+        if (capture >> 8 == CAPTURE_LOCAL) {
+          closure->upvalues[i] = OBJ_VAL(captureValue(slots + index));
+        } else if (capture >> 8 == CAPTURE_VALUE) {
+          closure->upvalues[i] = slots[index];
+        } else {
+          closure->upvalues[i] = frame->closure->upvalues[index];
+        }
+        writeBarrier((Obj*)closure, closure->upvalues[i]);
+      }
+      SAFEPOINT();
+      DISPATCH();
+    }
+    CASE(ROP_CLOSE_UPVALUES)
+      closeUpvalues(&RA());
+      DISPATCH();
+    CASE(ROP_RETURN) {
+      Value result = RKB();
+      closeUpvalues(slots);
+      vm.frameCount--;
+
+      if (vm.frameCount == 0) {
+        vm.stack.top = slots;
+        return INTERPRET_OK;
+      }
+
+      // the callee's slot 0 is the caller's R(A) of the call.
+      slots[0] = result;
+      LOAD_FRAME();
+      vm.stack.top = frame->top;
+      DISPATCH();
+    }
+    }
+  }
+
+#undef CASE
+#undef DISPATCH
+#undef TRACE_INSTRUCTION
+#undef PROFILE_INSTRUCTION
+#undef NUMBER_COMPARE_JUMPZ
+#undef COMPARE_JUMPZ
+#undef BINARY_OP
+#undef GLOBAL_NAME
+#undef RKC
+#undef RKB
+#undef RA
+#undef RK
+#undef SAFEPOINT
+#undef RUNTIME_ERROR
+#undef STORE_FRAME
+#undef LOAD_FRAME
 }
 
 InterpretResult interpret(const char* source) {
@@ -441,5 +1359,88 @@ InterpretResult interpret(const char* source) {
   push(OBJ_VAL(closure));
   callValue(OBJ_VAL(closure), 0);
 
+  if (vm.registerMode) {
+    enterRegisterFrame(vm.stack.top);
+    return runRegisters();
+  }
   return run();
+}
+
+// the functions below are the runtime of the C that clox --emit-c
+// generates (see emitc.h), that C never goes through run().
+
+ObjFunction* loadFunction(CompiledFn compiled, int arity, int maxStack,
+                          int upvalueCount, const char* name,
+                          const uint8_t* code, const int* lines, int count) {
+  ObjFunction* function = newFunction();
+  // every loaded function stays on the stack until runCompiled().
+  push(OBJ_VAL(function));
+  function->compiled = compiled;
+  function->arity = arity;
+  function->maxStack = maxStack;
+  function->upvalueCount = upvalueCount;
+  if (name != NULL) {
+    function->name = copyString(name, (int)strlen(name));
+    writeBarrier((Obj*)function, OBJ_VAL(function->name));
+  }
+  // the bytecode is kept for the line numbers of runtime errors.
+  for (int i = 0; i < count; i++) {
+    writeChunk(&function->chunk, code[i], lines[i]);
+  }
+  return function;
+}
+
+void loadConstant(ObjFunction* function, Value value) {
+  addConstant(&function->chunk, value);
+  writeBarrier((Obj*)function, value);
+}
+
+// calls the callee under the "argCount" arguments on top of the
+// stack, leaving its result in the callee's place.
+bool callCompiled(int argCount) {
+  // a safepoint: the caller keeps its values on the stack
+  // and reloads its closure after the call.
+  if (safepointDue())
+    gcSafepoint();
+  Value callee = peek(argCount);
+  if (!callValue(callee, argCount)) {
+    return false;
+  }
+  if (!IS_CLOSURE(callee)) {
+    return true;
+  }
+
+  // a tail call returns with the frame still there and the callee
+  // as its closure, run them until the frame is popped.
+  int frameCount = vm.frameCount;
+  do {
+    CallFrame* frame = &vm.frames[frameCount - 1];
+    if (!frame->closure->function->compiled(frame->slots)) {
+      return false;
+    }
+  } while (vm.frameCount == frameCount);
+  return true;
+}
+
+bool returnCompiled(Value* slots, Value result) {
+  closeUpvalues(slots);
+  vm.frameCount--;
+  slots[0] = result;
+  vm.stack.top = slots + 1;
+  return true;
+}
+
+InterpretResult runCompiled(ObjFunction* script) {
+  // nothing gets interpreted, so there is nothing to JIT.
+  vm.jitEnabled = false;
+  vm.stack.top = vm.stack.values;
+  push(OBJ_VAL(script));
+  ObjClosure* closure = newClosure(script);
+  pop();
+  push(OBJ_VAL(closure));
+  if (!callCompiled(0)) {
+    return INTERPRET_RUNTIME_ERROR;
+  }
+  vm.stack.top = vm.stack.values;
+  return INTERPRET_OK;
 }
\ No newline at end of file
@@ -2,14 +2,17 @@
 #define clox_vm_h
 
 #include "chunk.h"
+#include "memory.h"
 #include "object.h"
 #include "table.h"
 #include "value.h"
 
-#define FRAMES_MAX 64
-// initial stack size
-// grows further dynamically as values are added
-#define STACK_SIZE 256
+// the default call depth limit, clox --max-depth <n> changes it.
+#define FRAMES_MAX 8192
+// the stack and the frame array start this small and grow (see
+// call()) as the calls get deeper.
+#define STACK_INITIAL (UINT8_MAX + 1)
+#define FRAMES_INITIAL 16
 
 typedef struct {
   ObjClosure* closure;
@@ -17,25 +20,84 @@ typedef struct {
   // the first slot that this function
   // can use;
   Value* slots;
+  // with --register: the position in the function's
+  // register code and the stack top while it runs.
+  uint32_t* pc;
+  Value* top;
 } CallFrame;
 
 /* stackTop points to where the next element is
- supposed to go. (points to an unused slot) */
+ supposed to go. (points to an unused slot)
+ the stack moves when it grows, every pointer into it
+ (frame slots, open upvalues) is rebased then. */
 
 typedef struct {
-  CallFrame frames[FRAMES_MAX];
+  // frames[0 .. frameCount - 1] are the running calls. the array
+  // moves when it grows, keep indices into it across calls.
+  CallFrame* frames;
   int frameCount;
+  int frameCapacity;
+  int maxFrames;
 
   ValueStack stack;
   // Interned strings in the VM.
   Table strings;
-  Obj* objects;
-  // global variables, ObjString* -> Value table
-  Table globals;
-  ObjUpvalue* openUpvalues;
+  // the old heap: the objects up to SLAB_MAX bytes are in the
+  // pages of their size class, allocated from the available ones
+  // (see memory.h). "objects" holds the larger ones.
+  Page* pages[SLAB_CLASSES];
+  Page* available[SLAB_CLASSES];
+  Page* sparePages;
+  int spareCount;
+  int objectCount;
+  int objectCapacity;
+  Obj** objects;
+  // global variables live in a flat array that the bytecode
+  // indexes directly. the compiler hands out the slots through
+  // globalSlots (ObjString* -> slot number), globalNames maps a
+  // slot back to its name for error messages.
+  Table globalSlots;
+  ValueArray globalNames;
+  ValueArray globalValues;
+  // the open upvalues by stack slot: openUpvalues[i] is the upvalue
+  // of vm.stack.values[i] while it is captured, NULL otherwise. all
+  // of them are below openTop.
+  ObjUpvalue** openUpvalues;
+  int openTop;
   int grayCount;
   int grayCapacity;
   Obj** grayStack;
+  // the GC runs once bytesAllocated passes nextGC.
+  size_t bytesAllocated;
+  size_t nextGC;
+  double heapGrowFactor;
+  // the young generation, objects are bump-allocated
+  // at nurseryTop (see memory.h).
+  uint8_t* nursery;
+  uint8_t* nurseryTop;
+  uint8_t* nurseryEnd;
+  // the old objects that may point into the nursery.
+  int rememberedCount;
+  int rememberedCapacity;
+  Obj** remembered;
+  // incremental marking, see memory.h.
+  bool gcIncremental;
+  GCPhase gcPhase;
+  int gcStepObjects;
+  size_t gcStepDebt;
+  // how many threads mark a full collection.
+  int gcThreads;
+  // mark on a background thread (clox --gc-concurrent).
+  bool gcConcurrent;
+  // the next safepoint compacts the slabs. a sweep asks for it once
+  // more than compactThreshold of the pages could be released.
+  bool compactPending;
+  double compactThreshold;
+  // run the register code (clox --register)
+  // instead of the stack bytecode.
+  bool registerMode;
+  // compile hot functions to machine code (off with --no-jit).
+  bool jitEnabled;
 } VM;
 
 typedef enum {
@@ -44,10 +106,72 @@ typedef enum {
   INTERPRET_COMPILE_ERROR
 } InterpretResult;
 
-VM vm;
+extern VM vm;
 
 void initVM();
 void freeVM();
 InterpretResult interpret(const char* source);
+int declareGlobal(ObjString* name);
+void runtimeError(const char* format, ...);
+// for keeping a value reachable while something allocates.
+void push(Value val);
+Value pop();
+
+static inline bool isYoung(Obj* object) {
+  return (uint8_t*)object >= vm.nursery && (uint8_t*)object < vm.nurseryEnd;
+}
+
+// the mark bit of an old slab object is in its page's mark
+// bitmap (see memory.h), the others have it in the header.
+static inline bool isMarked(Obj* object) {
+  if (isYoung(object) || object->isLarge)
+    return object->isMarked;
+  uintptr_t bit = BIT_OF(object);
+  return (PAGE_OF(object)->marks[bit / 64] >> (bit % 64)) & 1;
+}
+
+// true when a safepoint should run gcSafepoint().
+static inline bool safepointDue() {
+#ifdef DEBUG_STRESS_GC
+  return vm.nurseryTop != vm.nursery || vm.compactPending;
+#else
+  return vm.nurseryTop - vm.nursery > NURSERY_MINOR || vm.compactPending;
+#endif
+}
+
+// call before overwriting "old" in a field. while marking, the
+// old value is marked: whatever was reachable when the cycle
+// began stays marked (snapshot at the beginning).
+static inline void preWriteBarrier(Value old) {
+  if (vm.gcPhase == GC_MARKING && IS_OBJ(old))
+    markObject(AS_OBJ(old));
+}
+
+// call after storing "value" in a field of "owner". while marking,
+// the value is marked too, whether or not the owner is: with
+// clox --gc-concurrent the marker thread may be blackening it.
+static inline void writeBarrier(Obj* owner, Value value) {
+  if (!IS_OBJ(value))
+    return;
+  Obj* object = AS_OBJ(value);
+  if (isYoung(object)) {
+    if (!owner->isRemembered && !isYoung(owner))
+      rememberObject(owner);
+  } else if (vm.gcPhase == GC_MARKING) {
+    markObject(object);
+  }
+}
+
+// used by the C that clox --emit-c generates.
+ObjString* joinStrings(ObjString* a, ObjString* b);
+ObjUpvalue* captureValue(Value* local);
+void closeUpvalues(Value* last);
+ObjFunction* loadFunction(CompiledFn compiled, int arity, int maxStack,
+                          int upvalueCount, const char* name,
+                          const uint8_t* code, const int* lines, int count);
+void loadConstant(ObjFunction* function, Value value);
+bool callCompiled(int argCount);
+bool returnCompiled(Value* slots, Value result);
+InterpretResult runCompiled(ObjFunction* script);
 
 #endif
\ No newline at end of file